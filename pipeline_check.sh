@@ -0,0 +1,42 @@
+#!/bin/bash
+# pipelined requests in one write, the last asking to close, must each get
+# a reply. usage: pipeline_check.sh [port], with ./sopa_server built.
+
+port=${1:-18080}
+./sopa_server -d -p "$port" -f sopa.html 2>/dev/null >/dev/null &
+pid=$!
+req=$(mktemp)
+trap 'kill $pid 2>/dev/null; rm -f "$req"' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	(exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null && break
+	sleep 0.2
+done
+# not some other server left on the port
+if ! kill -0 $pid 2>/dev/null; then
+	echo "FAIL: ./sopa_server didn't start on port $port"
+	exit 1
+fi
+
+fail=0
+# requests, replies expected
+check() {
+	local got
+
+	# in one write, printf would send a line at a time
+	printf "$1" > "$req"
+	exec 3<>"/dev/tcp/127.0.0.1/$port" || exit 1
+	cat "$req" >&3
+	got=$(timeout 5 cat <&3 | grep -ac '^HTTP/1.1 ')
+	exec 3<&-
+	if [ "$got" != "$2" ]; then
+		echo "FAIL: $2 replies expected, got $got: $1"
+		fail=1
+	fi
+}
+
+check 'GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\nConnection: close\r\n\r\n' 2
+check 'GET / HTTP/1.1\r\n\r\nGET / HTTP/1.0\r\n\r\n' 2
+check 'GET / HTTP/1.1\r\nConnection: close\r\n\r\nGET / HTTP/1.1\r\n\r\n' 1
+check 'GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\nConnection: close\r\n\r\n' 3
+[ $fail = 0 ] && echo "pipeline checks passed"
+exit $fail
@@ -0,0 +1,203 @@
+/* Copyright (c) 2012 Jon Mayo <jon@cobra-kai.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* microbenchmark of the request header scanners: the old one byte at a
+ * time state machine fed 64 byte reads, against the memchr() line scanner
+ * in sopa_server.c fed from its 1024 byte per connection buffer.
+ *
+ * both are copies, not the server's code: new_scan() is the loop of
+ * client_parse() as of when this was written, without the header
+ * handling, the limits and the rejections. it is not kept in step with
+ * the server, so compare with the real thing (make bench) before drawing
+ * conclusions from a change to client_parse(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OLD_BUFSIZE 64
+#define NEW_BUFSIZE 1024
+
+/* what a browser sends for a typical page view, about 400 bytes */
+static const char request[] =
+	"GET / HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+		"Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+		"image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"\r\n";
+
+struct scanner {
+	int state;
+	unsigned in_ofs, in_len, scan_ofs;
+	char in[NEW_BUFSIZE];
+};
+
+/* the original client_read() loop. returns 1 on a complete request, 0 if
+ * more is needed and -1 on a bad one. */
+static int old_scan(struct scanner *sc, const char *buf, size_t len)
+{
+	while (len > 0) {
+		switch (sc->state) {
+		case 0:
+			if (*buf != 'G')
+				return -1;
+			sc->state++;
+			break;
+		case 1:
+			if (*buf != 'E')
+				return -1;
+			sc->state++;
+			break;
+		case 2:
+			if (*buf != 'T')
+				return -1;
+			sc->state++;
+			break;
+		case 3:
+			if (*buf != ' ')
+				return -1;
+			sc->state++;
+			break;
+		case 4:
+			if (*buf == '\n')
+				sc->state++;
+			break;
+		case 5:
+			if (*buf == '\r' || *buf == '\n') {
+				sc->state = 0;
+				return 1;
+			}
+			sc->state++;
+			break;
+		case 6:
+			if (*buf == '\n')
+				sc->state = 5;
+			break;
+		}
+		buf++;
+		len--;
+	}
+	return 0;
+}
+
+/* the client_parse() scanner, minus the header handling */
+static int new_scan(struct scanner *sc)
+{
+	while (sc->in_ofs < sc->in_len) {
+		char *line = sc->in + sc->in_ofs;
+		size_t avail = sc->in_len - sc->in_ofs;
+		size_t len;
+		char *nl;
+
+		if (sc->state == 0 && memcmp(line, "GET ", avail < 4 ? avail : 4))
+			return -1;
+		nl = memchr(line + sc->scan_ofs, '\n', avail - sc->scan_ofs);
+		if (!nl) {
+			sc->scan_ofs = avail;
+			return 0;
+		}
+		sc->in_ofs = nl + 1 - sc->in;
+		sc->scan_ofs = 0;
+		len = nl - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		if (sc->state == 0) {
+			sc->state = 1;
+		} else if (!len) {
+			sc->state = 0;
+			sc->in_ofs = sc->in_len = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const size_t reqlen = sizeof(request) - 1;
+	long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	struct scanner sc;
+	unsigned long old_reads = 0, new_reads = 0, done = 0;
+	double start, old_t, new_t;
+	long i;
+	size_t ofs;
+
+	memset(&sc, 0, sizeof(sc));
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		/* each chunk is what one read() would have returned */
+		for (ofs = 0; ofs < reqlen; ofs += OLD_BUFSIZE) {
+			size_t n = reqlen - ofs < OLD_BUFSIZE ?
+				reqlen - ofs : OLD_BUFSIZE;
+
+			old_reads++;
+			if (old_scan(&sc, request + ofs, n) == 1)
+				done++;
+		}
+	}
+	old_t = now() - start;
+	if (done != (unsigned long)iterations) {
+		fprintf(stderr, "old scanner found %lu requests\n", done);
+		return EXIT_FAILURE;
+	}
+
+	memset(&sc, 0, sizeof(sc));
+	done = 0;
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		for (ofs = 0; ofs < reqlen; ofs += NEW_BUFSIZE) {
+			size_t n = reqlen - ofs < NEW_BUFSIZE ?
+				reqlen - ofs : NEW_BUFSIZE;
+
+			memcpy(sc.in + sc.in_len, request + ofs, n);
+			sc.in_len += n;
+			new_reads++;
+			if (new_scan(&sc) == 1)
+				done++;
+		}
+	}
+	new_t = now() - start;
+	if (done != (unsigned long)iterations) {
+		fprintf(stderr, "new scanner found %lu requests\n", done);
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu byte request, %ld iterations\n", reqlen, iterations);
+	printf("state machine: %7.1f ns/request, %.1f reads/request\n",
+		old_t * 1e9 / iterations, (double)old_reads / iterations);
+	printf("memchr lines:  %7.1f ns/request, %.1f reads/request\n",
+		new_t * 1e9 / iterations, (double)new_reads / iterations);
+	printf("speedup:       %7.2fx\n", old_t / new_t);
+	return 0;
+}
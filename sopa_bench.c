@@ -0,0 +1,476 @@
+/* Copyright (c) 2012 Jon Mayo <jon@cobra-kai.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* load generator for sopa_server. keeps N connections busy with GETs for
+ * a while, with or without keep-alive, and reports throughput, latency
+ * percentiles and how much CPU the server spent per request.
+ *
+ *   sopa_bench [options] [-- server command line]
+ *
+ * with a command line the server is started first and stopped after,
+ * otherwise -P names the pid of a running one to measure. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 18080
+#define BENCH_CONNS 50
+#define BENCH_SECONDS 5
+#define HDR_MAX 4096
+
+#define perror_and_die(reason) do { \
+		perror(reason); \
+		exit(EXIT_FAILURE); \
+	} while(0)
+
+/* connection states */
+#define ST_CONNECTING 0
+#define ST_SENDING 1
+#define ST_READING 2
+
+struct conn {
+	int fd;
+	int state;
+	size_t sent; /* bytes of the request written */
+	size_t hdr_len; /* bytes of the response header collected */
+	long long body_left; /* -1 until the header is complete */
+	uint64_t start; /* when this request began, in microseconds */
+	char hdr[HDR_MAX];
+};
+
+static struct sockaddr_in server;
+static int keepalive = 1;
+static char request[512];
+static size_t request_len;
+static uint32_t *samples; /* latency of each request, microseconds */
+static size_t nsamples, samples_size;
+static unsigned long long errors, bytes_read;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record(uint64_t usec)
+{
+	if (nsamples == samples_size) {
+		samples_size = samples_size ? samples_size * 2 : 65536;
+		samples = realloc(samples, samples_size * sizeof(*samples));
+		if (!samples)
+			perror_and_die("realloc()");
+	}
+	samples[nsamples++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+static int conn_open(struct conn *c)
+{
+	struct linger lg = { 1, 0 };
+	int op = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->fd < 0)
+		perror_and_die("socket()");
+	/* reset on close, so a long run doesn't use up ports in TIME_WAIT */
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &op, sizeof(op));
+	if (fcntl(c->fd, F_SETFL, O_NONBLOCK))
+		perror_and_die("fcntl()");
+	c->state = ST_CONNECTING;
+	c->sent = 0;
+	c->hdr_len = 0;
+	c->body_left = -1;
+	c->start = now_usec();
+	if (connect(c->fd, (struct sockaddr*)&server, sizeof(server)) &&
+		errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+	if (c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+}
+
+/* the reply is in, start the next request on this connection or a new one */
+static void conn_done(struct conn *c)
+{
+	uint64_t t = now_usec();
+
+	record(t - c->start);
+	if (!keepalive) {
+		conn_close(c);
+		if (conn_open(c))
+			errors++;
+		return;
+	}
+	c->state = ST_SENDING;
+	c->sent = 0;
+	c->hdr_len = 0;
+	c->body_left = -1;
+	c->start = t;
+}
+
+static void conn_fail(struct conn *c)
+{
+	errors++;
+	conn_close(c);
+	if (conn_open(c))
+		errors++;
+}
+
+/* once the header is complete, how much body follows it */
+static int parse_header(struct conn *c, size_t len)
+{
+	char *end, *p;
+
+	c->hdr[c->hdr_len] = 0;
+	end = strstr(c->hdr, "\r\n\r\n");
+	if (!end)
+		return c->hdr_len < sizeof(c->hdr) - 1 ? 0 : -1;
+	if (strncmp(c->hdr, "HTTP/1.1 2", 10) &&
+		strncmp(c->hdr, "HTTP/1.1 3", 10))
+		return -1;
+	c->body_left = 0;
+	for (p = c->hdr; p < end; p++) {
+		if (*p == '\n' && !strncasecmp(p + 1, "Content-Length:", 15)) {
+			c->body_left = atoll(p + 16);
+			break;
+		}
+	}
+	/* what came after the header was already body */
+	c->body_left -= (c->hdr + len) - (end + 4);
+	return 1;
+}
+
+static void conn_read(struct conn *c)
+{
+	char buf[65536];
+	ssize_t res;
+
+	while (1) {
+		if (c->body_left < 0) {
+			res = read(c->fd, c->hdr + c->hdr_len,
+				sizeof(c->hdr) - 1 - c->hdr_len);
+			if (res <= 0)
+				break;
+			bytes_read += res;
+			c->hdr_len += res;
+			switch (parse_header(c, c->hdr_len)) {
+			case -1:
+				conn_fail(c);
+				return;
+			case 0:
+				continue;
+			}
+		} else if (c->body_left > 0) {
+			res = read(c->fd, buf, (size_t)c->body_left < sizeof(buf) ?
+				(size_t)c->body_left : sizeof(buf));
+			if (res <= 0)
+				break;
+			bytes_read += res;
+			c->body_left -= res;
+		}
+		if (c->body_left == 0) {
+			conn_done(c);
+			return;
+		}
+		if (c->body_left < 0) {
+			/* pipelining isn't used, more than was asked for */
+			conn_fail(c);
+			return;
+		}
+	}
+	if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+		errno != EINTR))
+		conn_fail(c);
+}
+
+static void conn_event(struct conn *c, short revents)
+{
+	ssize_t res;
+
+	if (c->state == ST_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			conn_fail(c);
+			return;
+		}
+		c->state = ST_SENDING;
+	}
+	if (c->state == ST_SENDING && (revents & (POLLOUT | POLLERR))) {
+		res = write(c->fd, request + c->sent, request_len - c->sent);
+		if (res < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				conn_fail(c);
+			return;
+		}
+		c->sent += res;
+		if (c->sent == request_len)
+			c->state = ST_READING;
+		return;
+	}
+	if (c->state == ST_READING && (revents & (POLLIN | POLLERR | POLLHUP)))
+		conn_read(c);
+}
+
+/* CPU seconds used so far by pid and its children still running, from
+ * /proc. -1 where that isn't available. */
+static double proc_cpu(pid_t pid)
+{
+	char path[64], buf[1024];
+	double total = 0;
+	long ticks = sysconf(_SC_CLK_TCK);
+	FILE *f;
+	int child;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(buf, sizeof(buf), f)) {
+		char *p = strrchr(buf, ')');
+		unsigned long utime, stime;
+
+		/* fields 14 and 15, counted from after the command name */
+		if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+			"%*u %lu %lu", &utime, &stime) == 2)
+			total = (double)(utime + stime) / ticks;
+	}
+	fclose(f);
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid,
+		(int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return total;
+	while (fscanf(f, "%d", &child) == 1) {
+		double c = proc_cpu(child);
+
+		if (c > 0)
+			total += c;
+	}
+	fclose(f);
+	return total;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p)
+{
+	size_t i = (size_t)(p / 100 * nsamples);
+
+	if (i >= nsamples)
+		i = nsamples - 1;
+	return samples[i];
+}
+
+/* start the server and wait until it takes connections */
+static pid_t server_start(char **argv)
+{
+	pid_t pid;
+	int i;
+
+	pid = fork();
+	if (pid == (pid_t)-1)
+		perror_and_die("fork()");
+	if (!pid) {
+		execvp(argv[0], argv);
+		perror_and_die(argv[0]);
+	}
+	for (i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int e = connect(fd, (struct sockaddr*)&server, sizeof(server));
+
+		close(fd);
+		if (!e)
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "%s:exited before accepting\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		usleep(50000);
+	}
+	fprintf(stderr, "%s:not accepting connections\n", argv[0]);
+	kill(pid, SIGTERM);
+	exit(EXIT_FAILURE);
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-hK] [-a <addr>] [-p <port>] [-c <n>] [-d <seconds>] [-u <path>] [-P <pid>] [-- server command]\n",
+		progname);
+	fprintf(stderr, "  -h    help\n");
+	fprintf(stderr, "  -K    no keep-alive, a new connection for each request\n");
+	fprintf(stderr, "  -a a  server address [127.0.0.1]\n");
+	fprintf(stderr, "  -p n  server port [%d]\n", BENCH_PORT);
+	fprintf(stderr, "  -c n  concurrent connections [%d]\n", BENCH_CONNS);
+	fprintf(stderr, "  -d n  seconds to run [%d]\n", BENCH_SECONDS);
+	fprintf(stderr, "  -u u  path to request [/]\n");
+	fprintf(stderr, "  -P n  pid of the server, for its CPU use\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const char *addr = "127.0.0.1";
+	const char *path = "/";
+	unsigned short port = BENCH_PORT;
+	unsigned nconns = BENCH_CONNS;
+	double seconds = BENCH_SECONDS;
+	pid_t pid = 0, spawned = 0;
+	struct conn *conns;
+	struct pollfd *pfd;
+	uint64_t start, end;
+	double cpu0 = -1, cpu1 = -1, elapsed;
+	unsigned i;
+	int c;
+
+	while ((c = getopt(argc, argv, "hKa:p:c:d:u:P:")) > 0) {
+		switch (c) {
+		case 'K':
+			keepalive = 0;
+			break;
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			if (atoi(optarg) < 1)
+				usage(argv[0]);
+			nconns = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atof(optarg);
+			if (seconds <= 0)
+				usage(argv[0]);
+			break;
+		case 'u':
+			path = optarg;
+			break;
+		case 'P':
+			pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+		fprintf(stderr, "%s:not an IPv4 address\n", addr);
+		return EXIT_FAILURE;
+	}
+	request_len = snprintf(request, sizeof(request),
+		"GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, addr,
+		keepalive ? "" : "Connection: close\r\n");
+	if (request_len >= sizeof(request)) {
+		fprintf(stderr, "%s:path too long\n", path);
+		return EXIT_FAILURE;
+	}
+	if (optind < argc)
+		pid = spawned = server_start(argv + optind);
+
+	conns = calloc(nconns, sizeof(*conns));
+	pfd = calloc(nconns, sizeof(*pfd));
+	if (!conns || !pfd)
+		perror_and_die("calloc()");
+	if (pid)
+		cpu0 = proc_cpu(pid);
+	start = now_usec();
+	end = start + (uint64_t)(seconds * 1e6);
+	for (i = 0; i < nconns; i++)
+		if (conn_open(&conns[i]))
+			errors++;
+	while (now_usec() < end) {
+		for (i = 0; i < nconns; i++) {
+			pfd[i].fd = conns[i].fd;
+			pfd[i].events = conns[i].state == ST_READING ?
+				POLLIN : POLLOUT;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, nconns, 100) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror_and_die("poll()");
+		}
+		for (i = 0; i < nconns; i++) {
+			if (conns[i].fd == -1 && conn_open(&conns[i]))
+				errors++;
+			else if (pfd[i].revents)
+				conn_event(&conns[i], pfd[i].revents);
+		}
+	}
+	elapsed = (now_usec() - start) / 1e6;
+	if (pid)
+		cpu1 = proc_cpu(pid);
+	for (i = 0; i < nconns; i++)
+		conn_close(&conns[i]);
+	if (spawned) {
+		kill(spawned, SIGTERM);
+		waitpid(spawned, NULL, 0);
+	}
+
+	printf("%s, %u connections, %.1f s\n",
+		keepalive ? "keep-alive" : "connection per request", nconns,
+		elapsed);
+	printf("requests:   %zu (%llu errors), %.0f req/s, %.1f MB/s\n",
+		nsamples, errors, nsamples / elapsed,
+		bytes_read / elapsed / 1e6);
+	if (nsamples) {
+		qsort(samples, nsamples, sizeof(*samples), cmp_u32);
+		printf("latency us: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+			percentile(50), percentile(90), percentile(99),
+			percentile(99.9), samples[nsamples - 1]);
+	}
+	if (cpu0 >= 0 && cpu1 >= 0 && nsamples)
+		printf("server cpu: %.2f us/request, %.0f%% of one core\n",
+			(cpu1 - cpu0) * 1e6 / nsamples,
+			(cpu1 - cpu0) * 100 / elapsed);
+	return errors && !nsamples ? EXIT_FAILURE : 0;
+}
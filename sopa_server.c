@@ -13,54 +13,422 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* accept4() */
+#include <arpa/inet.h>
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#if defined(__linux__)
+#define HAVE_EPOLL
+#define HAVE_SENDFILE
+#define HAVE_AFFINITY
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__FreeBSD__) || defined(__DragonFly__)
+#define HAVE_SENDFILE
+#endif
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || \
+	defined(__DragonFly__) || defined(__APPLE__)
+#define HAVE_KQUEUE
+#include <sys/event.h>
+#endif
+
 /* port serve */
 #define HTTP_PORT 80
+#define HTTPS_PORT 443
 /* uid for a safe http user */
 #define HTTP_USER 33
-/* timeout in seconds for idle connections */
+/* timeout in seconds for a request or reply that stops making progress */
 #define HTTP_TIMEOUT 5
+/* timeout in seconds for keep-alive connections between requests */
+#define HTTP_IDLE_TIMEOUT 15
+/* timeout in seconds for the whole of a request header to arrive, however
+ * steadily it trickles in */
+#define HTTP_HEADER_TIMEOUT 10
 /* maximum size of a header, this is pretty important. */
 #define HTTP_HDRMAX 512
-/* buffer length for processing requests, just a performance parameter */
-#define HTTP_BUFSIZE 64
+/* per connection request buffer, also the longest request or header line
+ * we look at. a longer request line is a 414, longer header lines are
+ * skipped. */
+#define HTTP_BUFSIZE 1024
+/* most bytes of header lines in one request, skipped ones included */
+#define HTTP_FIELDS_MAX (16 * 1024)
+/* seconds a rejected connection is read from, and what it sends dropped,
+ * before it is closed */
+#define HTTP_LINGER 2
+/* pipelined requests answered with one batched write */
+#define HTTP_PIPELINE 8
+/* most connections accepted on one wakeup of the listening socket */
+#define HTTP_ACCEPT_BUDGET 64
+/* deepest subdirectory loaded with -r, also stops symlink loops */
+#define HTTP_MAXDEPTH 16
+/* default size of each worker's pool of clients */
+#define HTTP_MAXCLIENTS 4096
+#define CACHE_LINE 64
+/* per worker access log buffer, a power of two */
+#define LOG_RING (64 * 1024)
+/* most of the request line, Referer and User-Agent kept for the log */
+#define LOG_REQMAX 256
+#define LOG_HDRMAX 160
+/* -R pacing, a paced writer may send this fraction of a second's worth at
+ * once, and after that waits until its bucket is full again */
+#define PACE_HZ 4
+/* maximum number of events to collect from one epoll/kqueue wakeup */
+#define EV_BATCH 256
+/* an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define DATE_LEN 29
+/* "Date: <date>\r\n" and the blank line that ends the header */
+#define DATE_LINE_LEN (6 + DATE_LEN + 4)
+/* the same field as an HPACK literal, name 33 from the static table */
+#define DATE_H2_LEN (3 + DATE_LEN)
 
 #define perror_and_die(reason) do { \
 		perror(reason); \
 		exit(EXIT_FAILURE); \
 	} while(0)
 
+/* interest flags passed to the event backend */
+#define EV_READ 1
+#define EV_WRITE 2
+
+/* request parser states */
+#define PARSE_REQUEST 0 /* expecting a request line */
+#define PARSE_HEADERS 1 /* expecting a header line or the blank line */
+
+/* client flags */
+#define CL_CLOSE 1 /* the request being parsed ends the connection */
+#define CL_LONGLINE 2 /* skipping the rest of a line that didn't fit in in[] */
+#define CL_IDLE 4 /* keep-alive, waiting for the next request */
+#define CL_INM 8 /* sent If-None-Match, which overrides If-Modified-Since */
+#define CL_HEAD 16 /* a HEAD request, the reply has no body */
+#define CL_RANGE 32 /* asked for a single byte range */
+#define CL_IFRANGE 64 /* sent If-Range, the range only applies if it held */
+#define CL_LOG 128 /* this request goes in the access log */
+#define CL_HANDSHAKE 256 /* TLS handshake still in progress */
+#define CL_KTLS 512 /* the kernel encrypts what we send, write it plainly */
+#define CL_LINGER 1024 /* rejected and shut down, waiting for the client to go */
+#define CL_CLOSING 2048 /* close once the queued replies are sent */
+#define CL_REQUEST (CL_INM | CL_HEAD | CL_RANGE | CL_IFRANGE | CL_LOG)
+
+/* one queued response, the pointers refer into entry, which belongs to
+ * content unless it is a canned error reply. the reply holds a reference
+ * on content until it has been sent. */
+struct reply {
+	struct content *content;
+	const struct entry *entry;
+	const char *hdr;
+	size_t hdr_len;
+	const char *h2hdr; /* the same header as an HPACK block */
+	size_t h2hdr_len;
+	const char *body;
+	size_t body_len;
+	int from_file; /* body is a window of entry->msg, not a variant */
+	char date[DATE_LINE_LEN]; /* date_line as of when it was queued */
+};
+
+struct h2;
+
+/* where a connection came from, as accept() gave it. for a Unix socket
+ * only the family is kept. */
+union peer_addr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+/* slots come from a pool, aligned so no two clients share a cache line.
+ * only the fields before replies[] are cleared for a new connection. */
 struct client {
 	int fd;
-	int state;
-	struct client *next;
+	int state; /* request parser, kept across reads and requests */
+	int events; /* EV_READ while a reader, EV_WRITE while a writer */
+	int flags;
+	unsigned accept; /* bit per variant allowed by Accept-Encoding */
+	/* the snapshot the request line was looked up in, and the answer */
+	struct content *content;
+	const struct entry *entry;
+	unsigned match; /* bit per representation If-None-Match listed */
+	time_t ims; /* If-Modified-Since, 0 if none */
+	unsigned ifrange; /* bit per representation If-Range matched */
+	/* Range, first is SIZE_MAX for a suffix "-last", last is SIZE_MAX
+	 * when left open */
+	size_t range_first, range_last;
+	/* the paced queue while parked, next is the free list when unused */
+	struct client *next, **prev;
+	struct client *tnext, **tprev; /* timing wheel slot */
+	int tslot;
 	time_t last;
-	unsigned write_ofs;
+	time_t begin; /* when we started waiting for the current request */
+	size_t write_ofs; /* bytes of replies[0] already sent */
+	unsigned nreplies;
+	unsigned in_ofs, in_len; /* unparsed bytes of in[] */
+	unsigned scan_ofs; /* how much of a partial line was already scanned */
+	unsigned fields_len; /* header bytes of this request so far */
+	/* -R token bucket, bytes that may be sent and when it was topped up */
+	size_t tokens;
+	uint64_t paced_at, paced_until;
+#ifdef HAVE_OPENSSL
+	SSL *ssl; /* NULL for a plain connection */
+#endif
+	struct h2 *h2; /* NULL unless the connection switched to HTTP/2 */
+	struct reply replies[HTTP_PIPELINE];
+	char in[HTTP_BUFSIZE];
+	/* the header of a 206 or 416, at most one in the queue at a time */
+	char range_hdr[HTTP_HDRMAX];
+	union peer_addr peer;
+	/* for the access log, only filled in when CL_LOG is set */
+	char log_req[LOG_REQMAX];
+	char log_referer[LOG_HDRMAX];
+	char log_agent[LOG_HDRMAX];
+} __attribute__((aligned(CACHE_LINE)));
+
+/* an event backend only tracks interest and reports readiness, the client
+ * state machine stays the same no matter which one is in use. */
+struct event_backend {
+	const char *name;
+	int (*init)(void);
+	/* change interest for fd from old_events to new_events, 0 means none */
+	int (*set)(int fd, int old_events, int new_events);
+	/* wait up to timeout_ms (-1 is forever), calling event_ready() */
+	int (*wait)(int timeout_ms);
+};
+
+/* the connection table, indexed by fd. what the loop needs to know about
+ * each connection is kept in dense arrays beside the pointer, so a change
+ * of state is a store of one byte and a scan over every connection stays
+ * in cache instead of chasing pointers through the pool. */
+#define CONN_FREE 0
+#define CONN_READ 1 /* waiting for a request, or the rest of one */
+#define CONN_IDLE 2 /* keep-alive, between requests */
+#define CONN_WRITE 3
+#define CONN_PACED 4 /* a writer out of tokens, on the paced queue */
+#define CONN_LISTEN 5 /* one of our listening sockets, not a client */
+#define CONN_LISTEN_TLS 6
+static struct client **conn_client; /* lookup from an event to its client */
+static unsigned char *conn_state;
+static time_t *conn_since; /* when a reader started waiting */
+static int conn_len; /* size of the arrays */
+static int conn_top; /* one past the highest fd in use */
+/* writers out of tokens, with no interest until paced_until. oldest first,
+ * since they all wait the same time. */
+static struct client *paced_head;
+static struct client **paced_tail = &paced_head;
+static struct client *client_pool;
+static struct client *client_free_list;
+static unsigned pool_size = HTTP_MAXCLIENTS;
+static unsigned pool_used, pool_high; /* in use now, and the most ever */
+/* an address from -l, or the -p and -P defaults. each worker has its own
+ * socket of a TCP one and with it its own accept queue, a Unix socket has
+ * only the one that they all share. sockets taken over from systemd or an
+ * old server are shared too, unless there is one for each worker. */
+struct listener {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int tls; /* connections start with a TLS handshake */
+	int shared; /* every worker accepts on all of fds[] */
+	int *fds; /* by worker, unless shared */
+	int nfds;
+	int owned; /* a Unix socket path to remove when we exit */
+};
+static struct listener *listeners;
+static unsigned nlisteners;
+static int defer_accept; /* seconds, 0 to accept on the handshake */
+static int fastopen_qlen;
+static int busy_poll; /* -Y, microseconds to spin on the NIC queue, or 0 */
+static int pin_fl; /* -A, a core for each worker */
+static int worker_id;
+static int worker_cpu = -1; /* what it is pinned to */
+static unsigned accept_budget = HTTP_ACCEPT_BUDGET;
+static int reserve_fd = -1; /* given up to take a connection off the backlog */
+static uint64_t accept_paused; /* loop_usec to resume accepting at, or 0 */
+static unsigned read_timeout = HTTP_TIMEOUT;
+static unsigned idle_timeout = HTTP_IDLE_TIMEOUT;
+static unsigned header_timeout = HTTP_HEADER_TIMEOUT;
+static unsigned peer_limit; /* -i, connections per address, 0 for any */
+static int sndbuf; /* -B, SO_SNDBUF of each connection, 0 to leave it */
+static int notsent_lowat; /* -N, TCP_NOTSENT_LOWAT, 0 to leave it */
+static size_t pace_rate; /* -R, bytes per second per connection, or 0 */
+static size_t pace_depth; /* size of the bucket */
+static const struct event_backend *ev;
+static int zerocopy_fl;
+static int mapstore_fl; /* -M, big bodies in anonymous mappings */
+static int mlock_fl; /* -m, keep the content in memory */
+static const char *filename = "sopa.html";
+static const char *docroot; /* -r, serve a directory tree instead */
+/* the file is reloaded relative to its directory, which we hold open
+ * since it may not be reachable by path after drop_root() and chdir("/").
+ * with -r this is the top of the tree and content_name is NULL. */
+static int content_dir = -1;
+static const char *content_name;
+#if defined(__linux__)
+#define HAVE_INOTIFY
+static int inotify_fd = -1;
+static void watch_read(void);
+#endif
+static volatile sig_atomic_t reload_pending;
+/* SIGQUIT, or the listeners were handed over. 2 once they are closed. */
+static volatile sig_atomic_t drain_pending;
+static volatile sig_atomic_t terminating;
+
+/* whether this worker accepts on fds[i] */
+static int listener_mine(const struct listener *l, int i)
+{
+	return l->shared || i == worker_id;
+}
+
+struct encoding {
+	const char *name; /* Content-Encoding token */
+	size_t (*compress)(char **out, const char *in, size_t in_len);
+};
+
+#ifdef HAVE_ZLIB
+static size_t compress_gzip(char **out, const char *in, size_t in_len);
+#endif
+#ifdef HAVE_BROTLI
+static size_t compress_br(char **out, const char *in, size_t in_len);
+#endif
+
+/* Accept-Encoding is parsed into a bit per entry of this table */
+static const struct encoding encodings[] = {
+#ifdef HAVE_BROTLI
+	{ "br", compress_br },
+#endif
+#ifdef HAVE_ZLIB
+	{ "gzip", compress_gzip },
+#endif
+	{ NULL, NULL }
+};
+/* an int, so loops over none of them don't compare unsigned < 0 */
+#define NR_VARIANTS ((int)(sizeof(encodings) / sizeof(*encodings) - 1))
+
+/* ETag of each representation, a hash of the file plus the encoding */
+#define ETAG_MAX 32
+
+/* with -M, bodies from this size on are mapped rather than on the heap,
+ * and from a huge page on they are put on huge pages */
+#define STORE_MAP_MIN (64 * 1024)
+#define STORE_HUGE (2 * 1024 * 1024)
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/* as of date_when. the prebuilt headers have no Date, it is sent from
+ * here after them so they are never written to while shared. */
+static char date_now[DATE_LEN + 1];
+static char date_line[DATE_LINE_LEN + 1];
+static char date_h2[DATE_H2_LEN + 1];
+static time_t date_when;
+
+/* a pre-compressed copy of msg, body is NULL when it wouldn't be smaller */
+struct variant {
+	unsigned enc; /* index into encodings[] */
+	char etag[ETAG_MAX];
+	char hdr[HTTP_HDRMAX];
+	size_t hdr_len;
+	char hdr304[HTTP_HDRMAX]; /* the Not Modified answer instead */
+	size_t hdr304_len;
+	char h2hdr[HTTP_HDRMAX]; /* both again for HTTP/2 */
+	size_t h2hdr_len;
+	char h2hdr304[HTTP_HDRMAX];
+	size_t h2hdr304_len;
+	char *body;
+	size_t body_len;
+};
+
+/* one file, with its response header worked out in advance */
+struct entry {
+	char *path; /* request-target, or the file name with -f */
+	const char *type;
+	struct stat st; /* to tell whether the file has changed */
+	char etag[ETAG_MAX]; /* empty for the canned errors */
+	char hdr[HTTP_HDRMAX];
+	size_t hdr_len;
+	char hdr304[HTTP_HDRMAX];
+	size_t hdr304_len;
+	char h2hdr[HTTP_HDRMAX]; /* as HPACK blocks */
+	size_t h2hdr_len;
+	char h2hdr304[HTTP_HDRMAX];
+	size_t h2hdr304_len;
+	char *msg;
+	size_t msg_len;
+	int msg_fd; /* kept open for sendfile() in zero-copy mode */
+	/* msg is a mapping this long, of the file with -z or anonymous with
+	 * -M. 0 for a heap copy. */
+	size_t map_len;
+	/* sorted so the smallest comes first */
+	struct variant variants[NR_VARIANTS + 1];
+};
+
+/* slot of the open addressed table from request-target to entry */
+struct route {
+	const char *key; /* points into entry->path, NULL for an empty slot */
+	size_t key_len;
+	uint32_t hash;
+	const struct entry *entry;
 };
 
-static struct client *reader_head;
-static struct client *writer_head; /* list of client waiting to write */
-static int fd_max;
-static time_t youngest;
-static fd_set rfds, wfds;
-static char hdr[HTTP_HDRMAX];
-static size_t hdr_len;
-static char *msg;
-static size_t msg_len;
+/* everything served, built off to the side by content_load() and never
+ * modified afterwards, apart from the Date in each header. a reload swaps
+ * in a new one while queued replies keep the old one alive. */
+struct content {
+	unsigned refs;
+	struct stat st; /* of the directory with -r, to notice new files */
+	struct entry *entries;
+	unsigned nentries;
+	size_t total; /* bytes in all the files */
+	/* NULL when serving a single file, which answers every target */
+	struct route *routes;
+	unsigned route_mask;
+};
+
+static struct content *current;
 static const char *progname;
 static const char *default_content_type = "text/html; charset=UTF-8";
 
@@ -87,428 +455,5913 @@ static void log_debug(const char *fmt, ...)
 #endif
 
 #ifndef NDEBUG
-static void dump_fdset(fd_set *fds)
+static void dump_conns(int state)
 {
-	int i;
+	int fd;
 
-	printf("(%p)", fds);
-	for (i = 0; i <= fd_max; i++) {
-		if (FD_ISSET(i, fds))
-			printf(" %d", i);
-	}
+	for (fd = 0; fd < conn_top; fd++)
+		if (conn_state[fd] == state)
+			printf(" %d", fd);
 	printf("\n");
 }
+#endif
+
+/**** statistics ****/
+
+/* loop latency buckets, the i'th counts iterations up to 2^i microseconds
+ * and the last one everything slower */
+#define STATS_BUCKETS 21
 
-static void dump_list(const struct client *head)
+/* counters of one worker. each worker only writes its own, in memory
+ * shared with all of them so any worker can report every worker. relaxed
+ * atomic stores are plain stores, so the hot path takes no locks. */
+struct stats {
+	uint64_t accepts;
+	uint64_t requests;
+	uint64_t bytes_written;
+	uint64_t partial_writes; /* writes that left part of a reply queued */
+	uint64_t timeouts;
+	uint64_t disconnects; /* closed by the client, or an error */
+	uint64_t wakeups; /* returns from the event backend with events */
+	uint64_t clients; /* connections open now */
+	uint64_t log_dropped; /* access log lines lost to a full buffer */
+	uint64_t refused; /* over the per-address limit */
+	uint64_t rejected; /* requests answered with a canned error */
+	uint64_t shed; /* readers closed to make room for a new connection */
+	uint64_t paced; /* writers held back to -R */
+	uint64_t tls_handshakes;
+	uint64_t tls_resumed; /* handshakes that used a session ticket */
+	uint64_t ktls; /* handshakes after which the kernel took over sending */
+	uint64_t h2; /* connections that switched to HTTP/2 */
+	uint64_t loop_usec; /* time spent handling events */
+	uint64_t loop_hist[STATS_BUCKETS];
+} __attribute__((aligned(CACHE_LINE)));
+
+#define STAT_ADD(field, n) __atomic_store_n(&stats->field, \
+	stats->field + (n), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&stats->field, (v), \
+	__ATOMIC_RELAXED)
+
+static struct stats stats_early; /* until the shared ones exist */
+static struct stats *stats = &stats_early;
+static struct stats *stats_all;
+static unsigned stats_count;
+static const char *stats_path; /* -s, NULL to not expose them */
+static uint64_t loop_start; /* when the backend returned, 0 while waiting */
+
+static uint64_t mono_usec(void)
 {
-	while (head) {
-		printf(" %d", head->fd);
-		head = head->next;
-	}
-	printf("\n");
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
-#endif
 
-static void client_free(struct client *cl, struct client **prev)
+/* the counters of every worker, made before the first fork() */
+static void stats_init(unsigned workers)
 {
-	assert(cl != NULL && prev != NULL);
-	assert(*prev == cl);
-	assert(cl->fd != -1);
-	*prev = cl->next;
-	cl->next = NULL;
-	log_debug("freeing client fd %d (%p)\n", cl->fd, cl);
-	close(cl->fd);
-	FD_CLR(cl->fd, &rfds);
-	FD_CLR(cl->fd, &wfds);
-	cl->fd = -1;
-	free(cl);
+	stats_all = mmap(NULL, workers * sizeof(*stats_all),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (stats_all == MAP_FAILED)
+		perror_and_die("stats");
+	stats_count = workers;
 }
 
-static void client_accept(int listen_fd)
+/**** clock ****/
+
+/* read once per wakeup, everything done for those events uses the same
+ * time. the coarse clocks are a plain read of what the kernel keeps, a
+ * few milliseconds behind, and the monotonic one doesn't jump with the
+ * wall clock, so timeouts don't either. */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define CLOCK_LOOP CLOCK_MONOTONIC_COARSE
+#define CLOCK_WALL CLOCK_REALTIME_COARSE
+#elif defined(CLOCK_MONOTONIC_FAST)
+#define CLOCK_LOOP CLOCK_MONOTONIC_FAST
+#define CLOCK_WALL CLOCK_REALTIME_FAST
+#else
+#define CLOCK_LOOP CLOCK_MONOTONIC
+#define CLOCK_WALL CLOCK_REALTIME
+#endif
+
+static time_t loop_now; /* monotonic seconds, for the timeouts */
+static uint64_t loop_usec; /* the same in microseconds, for pacing */
+static time_t wall_now; /* for Date and the access log */
+
+static void date_tick(time_t now);
+
+static void clock_update(void)
 {
-	int newfd;
-	struct sockaddr_in sin;
-	socklen_t len = sizeof(sin);
-	struct client *new;
+	struct timespec ts;
 
-	newfd = accept(listen_fd, (struct sockaddr*)&sin, &len);
-	if (newfd < 0) {
-		if (errno != EAGAIN)
-			perror_and_die("accept()");
-		return;
-	}
-	log_info("new client fd %d\n", newfd);
-	new = calloc(1, sizeof(*new));
-	new->fd = newfd;
-	time(&new->last);
-	new->next = reader_head;
-	reader_head = new;
-	FD_SET(new->fd, &rfds);
-	if (new->fd > fd_max)
-		fd_max = newfd;
-	assert(new != new->next);
+	clock_gettime(CLOCK_LOOP, &ts);
+	loop_now = ts.tv_sec;
+	loop_usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	clock_gettime(CLOCK_WALL, &ts);
+	wall_now = ts.tv_sec;
+	date_tick(wall_now);
 }
 
-static int client_write(struct client *cl,
-	struct client **prev __attribute__((unused)))
+/* called by the event backends when their syscall returns with events */
+static void loop_awake(void)
 {
-	const char *buf;
-	size_t buflen;
-	ssize_t res;
+	loop_start = mono_usec();
+	STAT_ADD(wakeups, 1);
+	clock_update();
+}
 
-	switch (cl->state) {
-		case 0:
-			buf = hdr;
-			buflen = hdr_len;
-			break;
-		case 1:
-			buf = msg;
-			buflen = msg_len;
-			break;
-		default:
-			log_info("closing fd %d:completed\n", cl->fd);
-			return 0;
-	}
+/* the events from the last wakeup have all been handled */
+static void loop_done(void)
+{
+	uint64_t usec;
+	unsigned i;
 
-	assert(buf != NULL);
-	assert(cl->fd != -1);
-	res = write(cl->fd, buf + cl->write_ofs, buflen - cl->write_ofs);
-	if (res < 0) {
-		log_info("closing fd %d:%s\n", cl->fd, strerror(errno));
-		return 0;
-	}
-	cl->write_ofs += res;
-	assert(cl->write_ofs <= buflen);
-	if (cl->write_ofs == buflen) {
-		cl->state++;
-		cl->write_ofs = 0;
-	}
-	time(&cl->last);
-	return 1;
+	if (!loop_start)
+		return;
+	usec = mono_usec() - loop_start;
+	loop_start = 0;
+	i = usec <= 1 ? 0 : 64 - __builtin_clzll(usec - 1);
+	if (i >= STATS_BUCKETS)
+		i = STATS_BUCKETS - 1;
+	STAT_ADD(loop_usec, usec);
+	STAT_ADD(loop_hist[i], 1);
 }
 
-static void do_get(struct client *cl, struct client **prev)
+/**** access log ****/
+
+/* lines are formatted into a ring as requests are answered and written out
+ * in batches before the loop waits again, and a full ring drops lines.
+ * O_NONBLOCK only helps with a pipe or FIFO, whose reader falling behind
+ * never holds up a reply. a regular file ignores it: a slow disk stalls
+ * the loop for one batched write() per wakeup. */
+static int access_fd = -1;
+static unsigned log_every = 1; /* -S, log one request in this many */
+static unsigned log_seq;
+static char log_ring[LOG_RING];
+static size_t log_head, log_tail; /* running totals, wrapped on use */
+static time_t log_when = -1;
+static char log_date[32];
+
+static void log_open(const char *path)
 {
-	assert(cl != cl->next);
-	log_debug("%s():%d:HERE\n", __func__, __LINE__);
-	/* transistion to a writer */
-	*prev = cl->next;
-	cl->next = writer_head;
-	writer_head = cl;
-	/* clear rfd bit and set wfd bit */
-	FD_CLR(cl->fd, &rfds);
-	FD_SET(cl->fd, &wfds);
-	cl->write_ofs = 0;
-	assert(cl != cl->next);
-	cl->state = 0;
+	access_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK |
+		O_CLOEXEC, 0644);
+	if (access_fd == -1)
+		perror_and_die(path);
 }
 
-static int client_read(struct client *cl, struct client **prev)
+/* copy for the log, quotes and control characters would let a client
+ * forge lines */
+static void log_copy(char *dst, size_t size, const char *src, size_t len)
 {
-	char _buf[HTTP_BUFSIZE];
-	char *buf = _buf;
-	ssize_t len = sizeof(_buf);
+	size_t i;
 
-	len = read(cl->fd, buf, len);
-	if (len <= 0) {
-		log_info("closing fd %d:%s\n", cl->fd, strerror(errno));
-		return 0;
-	}
-	log_debug("%s():fd %d read %d bytes\n", __func__, cl->fd, len);
-	time(&cl->last);
-	while (len > 0) {
-		log_debug("read fd %d:state=%d ch='%c' (%#x)\n",
-			cl->fd, cl->state, *buf, *buf);
-		switch (cl->state) {
-		case 0:
-			if (*buf == 'G')
-				cl->state++;
-			else
-				return 0;
-			break;
-		case 1:
-			if (*buf == 'E')
-				cl->state++;
-			else
-				return 0;
-			break;
-		case 2:
-			if (*buf == 'T')
-				cl->state++;
-			else
-				return 0;
-			break;
-		case 3:
-			if (*buf == ' ')
-				cl->state++;
-			else
-				return 0;
-			break;
-		case 4:
-			log_debug("%s():%d:HERE\n", __func__, __LINE__);
-			if (*buf == '\n')
-				cl->state++;
-			break;
-		case 5: /* detect blank line - starts with \r or \n */
-			log_debug("%s():%d:HERE\n", __func__, __LINE__);
-			if (*buf == '\r' || *buf == '\n') {
-				do_get(cl, prev);
-				return 1;
-			} else {
-				cl->state++;
-			}
-			break;
-		case 6: /* loop through arguments */
-			if (*buf == '\n')
-				cl->state = 5;
-			break;
-		}
-		buf++;
+	while (len && (*src == ' ' || *src == '\t')) {
+		src++;
 		len--;
 	}
+	for (i = 0; i + 1 < size && i < len; i++) {
+		unsigned char c = src[i];
 
-	return 1;
+		dst[i] = (c < ' ' || c == 127 || c == '"' || c == '\\') ?
+			'_' : c;
+	}
+	dst[i] = 0;
 }
 
-static void process_generic(struct client **head, fd_set *fds,
-	int (*foreach)(struct client *cl, struct client **prev))
+static void log_append(const char *line, size_t len)
 {
-	struct client *curr, **prev;
-	time_t timeout;
+	size_t ofs = log_head & (LOG_RING - 1);
+	size_t n = LOG_RING - ofs;
 
-	time(&timeout);
-	timeout -= HTTP_TIMEOUT;
-	for (prev = head; (curr = *prev); ) {
-		if (curr->last < youngest) {
-			/* log_debug("fd %d:%d is younger than %d\n",
-				curr->fd, curr->last, youngest); */
-			youngest = curr->last;
-		}
-		if (curr->last <= timeout) {
-			log_info("closing fd %d, timeout\n", curr->fd);
-			client_free(curr, prev);
-			continue;
-		}
-		log_debug("%s():checking fd %d (set=%d)\n", __func__,
-			curr->fd, FD_ISSET(curr->fd, fds));
-		if (FD_ISSET(curr->fd, fds) && !foreach(curr, prev)) {
-			log_info("closing fd %d, disconnect\n", curr->fd);
-			client_free(curr, prev);
-			continue;
-		}
-		log_debug("add fd %d back to fdset %p\n", curr->fd, fds);
-		FD_SET(curr->fd, fds); /* set for next select() */
-		prev = &curr->next;
+	if (len > LOG_RING - (log_head - log_tail)) {
+		STAT_ADD(log_dropped, 1);
+		return;
 	}
+	if (n > len)
+		n = len;
+	memcpy(log_ring + ofs, line, n);
+	memcpy(log_ring, line + n, len - n);
+	log_head += len;
 }
 
-static void process_readers(void)
+/* every log_every'th request goes in the access log, if there is one */
+static void log_start(struct client *cl, const char *line, size_t len)
 {
-	process_generic(&reader_head, &rfds, client_read);
+	if (access_fd == -1 || ++log_seq % log_every)
+		return;
+	cl->flags |= CL_LOG;
+	log_copy(cl->log_req, sizeof(cl->log_req), line, len);
+	cl->log_referer[0] = 0;
+	cl->log_agent[0] = 0;
 }
 
-static void process_writers(void)
+/* one line in the combined format */
+static void log_request(const struct client *cl, const char *status,
+	size_t bytes)
 {
-	process_generic(&writer_head, &wfds, client_write);
+	char addr[INET6_ADDRSTRLEN];
+	char line[LOG_REQMAX + 2 * LOG_HDRMAX + 128];
+	const char *a = NULL;
+	int len;
+
+	if (wall_now != log_when) {
+		log_when = wall_now;
+		strftime(log_date, sizeof(log_date), "%d/%b/%Y:%H:%M:%S +0000",
+			gmtime(&wall_now));
+	}
+	switch (cl->peer.sa.sa_family) {
+	case AF_INET:
+		a = inet_ntop(AF_INET, &cl->peer.sin.sin_addr, addr,
+			sizeof(addr));
+		break;
+	case AF_INET6:
+		a = inet_ntop(AF_INET6, &cl->peer.sin6.sin6_addr, addr,
+			sizeof(addr));
+		break;
+	case AF_UNIX:
+		a = "unix:";
+		break;
+	}
+	len = snprintf(line, sizeof(line),
+		"%s - - [%s] \"%s\" %.3s %zu \"%s\" \"%s\"\n", a ? a : "-",
+		log_date, cl->log_req, status, bytes,
+		cl->log_referer[0] ? cl->log_referer : "-",
+		cl->log_agent[0] ? cl->log_agent : "-");
+	if (len > 0 && (size_t)len < sizeof(line))
+		log_append(line, len);
 }
 
-static void encode_hdr(time_t mtime, const char *content_type)
+/* write out what has been logged, as much as the file takes right now.
+ * each write() is whole lines, in one piece even where they cross the end
+ * of the ring, and no more than PIPE_BUF, which a pipe takes atomically.
+ * so workers sharing the O_APPEND file or a pipe never split each other's
+ * lines. only a short write leaves a partial line for the next flush. */
+static void log_flush(void)
 {
-	char timebuf[128];
-	struct tm *tm;
+	char buf[PIPE_BUF];
 
-	tm = gmtime(&mtime);
-	strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %T %z", tm);
+	while (log_tail != log_head) {
+		size_t ofs = log_tail & (LOG_RING - 1);
+		size_t n = log_head - log_tail;
+		const char *p = log_ring + ofs;
+		size_t len;
+		ssize_t res;
 
-	hdr_len = snprintf(hdr, sizeof(hdr),
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: %s\r\n"
-		"Date: %s\r\n"
-		"Content-Length: %zu\r\n"
-		"\r\n", content_type, timebuf, msg_len);
-	if (hdr_len >= sizeof(hdr))
-		perror_and_die("snprintf()");
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+		if (n > LOG_RING - ofs) {
+			memcpy(buf, p, LOG_RING - ofs);
+			memcpy(buf + (LOG_RING - ofs), log_ring,
+				n - (LOG_RING - ofs));
+			p = buf;
+		}
+		for (len = n; len && p[len - 1] != '\n'; len--)
+			;
+		if (!len)
+			len = n; /* the rest of a line cut by a short write */
+		res = write(access_fd, p, len);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR)
+				return; /* try again after the next wakeup */
+			log_info("access log:%s\n", strerror(errno));
+			log_tail = log_head;
+			return;
+		}
+		log_tail += res;
+	}
 }
 
-static void load_file(const char *filename)
-{
-	int fd;
-	int e;
-	ssize_t len;
-	struct stat st;
-	int tries = 10;
+static void event_ready(int fd, int events);
 
-	fd = open(filename, O_RDONLY);
-	if (fd == -1)
-		perror_and_die(filename);
-	do {
-		e = fstat(fd, &st);
-		if (e)
-			perror_and_die(filename);
-		free(msg);
-		msg_len = st.st_size;
-		msg = calloc(1, st.st_size + 1);
-		len = read(fd, msg, msg_len);
-		if (len < 0)
-			perror_and_die(filename);
-		if (!tries--) { /* give up if we fail the race too many times */
-			log_info("%s:unable to determine size of file\n",
-				filename);
-			abort();
-		}
-	} while ((size_t)len != msg_len);
-	close(fd);
-	encode_hdr(st.st_mtime, default_content_type);
+/**** select() backend - always available, limited to FD_SETSIZE ****/
+
+static fd_set sel_rfds, sel_wfds;
+static int sel_fd_max = -1;
+
+static int sel_init(void)
+{
+	FD_ZERO(&sel_rfds);
+	FD_ZERO(&sel_wfds);
+	sel_fd_max = -1;
+	return 0;
 }
 
-static void drop_root(void)
+static int sel_set(int fd, int old_events __attribute__((unused)),
+	int new_events)
 {
-	if (getuid() == 0)
-		if (setuid(HTTP_USER))
-			perror_and_die("setuid()");
+	if (fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+	if (new_events & EV_READ)
+		FD_SET(fd, &sel_rfds);
+	else
+		FD_CLR(fd, &sel_rfds);
+	if (new_events & EV_WRITE)
+		FD_SET(fd, &sel_wfds);
+	else
+		FD_CLR(fd, &sel_wfds);
+	if (new_events && fd > sel_fd_max)
+		sel_fd_max = fd;
+	return 0;
 }
 
-static void daemonize(void)
+static int sel_wait(int timeout_ms)
 {
-	pid_t pid;
-	pid_t sid;
+	fd_set rfds = sel_rfds, wfds = sel_wfds;
+	struct timeval tv, *tvp = NULL;
+	int e, i;
 
-	/* check if we're already a daemon */
-	if (getppid() == 1)
-		return;
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		tvp = &tv;
+	}
+	e = select(sel_fd_max + 1, &rfds, &wfds, NULL, tvp);
+	if (e < 0)
+		return errno == EINTR ? 0 : -1;
+	if (e)
+		loop_awake();
+	for (i = 0; e > 0 && i <= sel_fd_max; i++) {
+		int events = 0;
 
-	if (chdir("/") < 0)
-		perror_and_die("chdir()");
-	pid = fork();
-	if (pid == (pid_t)-1)
-		perror_and_die("fork()");
-	if (pid)
-		exit(EXIT_SUCCESS); /* exit parent */
-	sid = setsid();
-	if (sid == (pid_t)-1)
-		perror_and_die("setsid()");
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
-	open("/dev/null", O_RDONLY);
-	open("/dev/null", O_WRONLY);
-	open("/dev/null", O_WRONLY);
+		if (FD_ISSET(i, &rfds))
+			events |= EV_READ;
+		if (FD_ISSET(i, &wfds))
+			events |= EV_WRITE;
+		if (events) {
+			e--;
+			event_ready(i, events);
+		}
+	}
+	return 0;
 }
 
-void usage(void)
+static const struct event_backend sel_backend = {
+	"select", sel_init, sel_set, sel_wait,
+};
+
+/**** epoll() backend - Linux ****/
+
+#ifdef HAVE_EPOLL
+static int epoll_fd = -1;
+
+static int epl_init(void)
 {
-	fprintf(stderr, "usage: %s [-hd] [-f <filename>] [-p <port>] [-t <type>\n",
-		progname);
-	fprintf(stderr, "  -h    help\n");
-	fprintf(stderr, "  -d    don't daemonize\n");
-	fprintf(stderr, "  -f f  file to serve\n");
-	fprintf(stderr, "  -p n  port to serve\n");
-	fprintf(stderr, "  -t t  content type [%s]\n", default_content_type);
-	exit(EXIT_FAILURE);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		return -1;
+#ifdef EPIOCSPARAMS
+	/* the socket option alone doesn't make epoll_wait() spin */
+	if (busy_poll) {
+		struct epoll_params ep;
+
+		memset(&ep, 0, sizeof(ep));
+		ep.busy_poll_usecs = busy_poll;
+		ep.busy_poll_budget = 8;
+		if (ioctl(epoll_fd, EPIOCSPARAMS, &ep))
+			log_info("EPIOCSPARAMS:%s\n", strerror(errno));
+	}
+#endif
+	return 0;
 }
 
-int main(int argc, char **argv)
+static int epl_set(int fd, int old_events, int new_events)
 {
-	int listen_fd;
-	struct sockaddr_in sin;
-	int e;
-	int op = 1;
-	int c;
-	int daemonize_fl = 1;
-	const char *filename = "sopa.html";
-	unsigned short port = HTTP_PORT;
+	struct epoll_event ee;
+	int op;
 
-	progname = strrchr(argv[0], '/');
-	if (progname)
-		progname++;
+	if (!new_events)
+		op = EPOLL_CTL_DEL;
+	else if (!old_events)
+		op = EPOLL_CTL_ADD;
 	else
-		progname = argv[0];
+		op = EPOLL_CTL_MOD;
+	memset(&ee, 0, sizeof(ee));
+	ee.data.fd = fd;
+	if (new_events & EV_READ)
+		ee.events |= EPOLLIN;
+	if (new_events & EV_WRITE)
+		ee.events |= EPOLLOUT;
+	return epoll_ctl(epoll_fd, op, fd, &ee);
+}
 
-	while ((c=getopt(argc, argv, "hdf:p:t:"))>0) {
-		switch(c) {
-		default:
-		case 'h':
-			usage();
-		case 'd':
-			daemonize_fl = 0;
-			break;
-		case 'f':
-			filename = optarg;
-			break;
-		case 'p':
-			port = atoi(optarg);
-			break;
-		case 't':
-			default_content_type = optarg;
-			break;
-		}
-	}
+static int epl_wait(int timeout_ms)
+{
+	struct epoll_event ee[EV_BATCH];
+	int e, i;
 
-	umask(0);
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0)
-		perror_and_die("socket()");
-	e = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
-	if (e)
-		perror_and_die("SO_REUSEADDR");
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	e = bind(listen_fd, (struct sockaddr*)&sin, sizeof(sin));
-	if (e)
-		perror_and_die("bind()");
-	e = fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+	e = epoll_wait(epoll_fd, ee, EV_BATCH, timeout_ms);
+	if (e < 0)
+		return errno == EINTR ? 0 : -1;
 	if (e)
-		perror_and_die("fcntl()");
-	e = listen(listen_fd, SOMAXCONN);
-	if (e)
-		perror_and_die("listen()");
-	fd_max = listen_fd;
-	youngest = INT_MAX;
+		loop_awake();
+	for (i = 0; i < e; i++) {
+		int events = 0;
 
-	drop_root();
-	load_file(filename);
+		if (ee[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			events |= EV_READ;
+		if (ee[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			events |= EV_WRITE;
+		event_ready(ee[i].data.fd, events);
+	}
+	return 0;
+}
 
-	if (daemonize_fl)
-		daemonize();
+static const struct event_backend epl_backend = {
+	"epoll", epl_init, epl_set, epl_wait,
+};
+#endif
 
-	memset(&rfds, 0, sizeof(rfds));
-	memset(&wfds, 0, sizeof(wfds));
-	FD_SET(listen_fd, &rfds);
+/**** kqueue() backend - BSD and macOS ****/
 
-	while (1) {
-		struct timeval _tv = { 0, 0 };
-		struct timeval *tv;
+#ifdef HAVE_KQUEUE
+static int kqueue_fd = -1;
 
-		if (youngest != INT_MAX) {
-			time_t now, expire = youngest + HTTP_TIMEOUT;
+static int kq_init(void)
+{
+	kqueue_fd = kqueue();
+	return kqueue_fd < 0 ? -1 : 0;
+}
 
-			time(&now);
-			tv = &_tv;
-			tv->tv_sec = (expire <= now) ? 0 : expire - now;
-			log_debug("wait for %d seconds\n", tv->tv_sec);
-		} else {
-			tv = NULL;
-			log_debug("waiting for new connections\n");
+static int kq_set(int fd, int old_events, int new_events)
+{
+	struct kevent kev[2];
+	int n = 0;
+	int changed = old_events ^ new_events;
+
+	if (changed & EV_READ) {
+		EV_SET(&kev[n], fd, EVFILT_READ,
+			(new_events & EV_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		n++;
+	}
+	if (changed & EV_WRITE) {
+		EV_SET(&kev[n], fd, EVFILT_WRITE,
+			(new_events & EV_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+		n++;
+	}
+	if (!n)
+		return 0;
+	return kevent(kqueue_fd, kev, n, NULL, 0, NULL);
+}
+
+static int kq_wait(int timeout_ms)
+{
+	struct kevent kev[EV_BATCH];
+	struct timespec ts, *tsp = NULL;
+	int e, i;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+	e = kevent(kqueue_fd, NULL, 0, kev, EV_BATCH, tsp);
+	if (e < 0)
+		return errno == EINTR ? 0 : -1;
+	if (e)
+		loop_awake();
+	for (i = 0; i < e; i++) {
+		if (kev[i].filter == EVFILT_READ)
+			event_ready(kev[i].ident, EV_READ);
+		else if (kev[i].filter == EVFILT_WRITE)
+			event_ready(kev[i].ident, EV_WRITE);
+	}
+	return 0;
+}
+
+static const struct event_backend kq_backend = {
+	"kqueue", kq_init, kq_set, kq_wait,
+};
+#endif
+
+/* in order of preference, the first one that initializes is used */
+static const struct event_backend *backends[] = {
+#ifdef HAVE_EPOLL
+	&epl_backend,
+#endif
+#ifdef HAVE_KQUEUE
+	&kq_backend,
+#endif
+	&sel_backend,
+	NULL
+};
+
+static void event_init(const char *name)
+{
+	const struct event_backend **b;
+
+	for (b = backends; *b; b++) {
+		if (name && strcmp(name, (*b)->name))
+			continue;
+		if (!(*b)->init()) {
+			ev = *b;
+			log_info("worker %d using %s event backend\n",
+				worker_id, ev->name);
+			return;
+		}
+		log_info("%s:%s\n", (*b)->name, strerror(errno));
+	}
+	if (name)
+		log_info("%s:unknown or unavailable event backend\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/**** content ****/
+
+static struct content *content_get(struct content *c)
+{
+	c->refs++;
+	return c;
+}
+
+/* an anonymous mapping of size aligned to a huge page, so that all of it
+ * can be backed by transparent ones */
+static char *store_map_huge(size_t size)
+{
+	char *p, *a;
+
+	p = mmap(NULL, size + STORE_HUGE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	a = (char*)(((uintptr_t)p + STORE_HUGE - 1) &
+		~(uintptr_t)(STORE_HUGE - 1));
+	if (a > p)
+		munmap(p, a - p);
+	munmap(a + size, p + STORE_HUGE - a);
+#ifdef MADV_HUGEPAGE
+	madvise(a, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+	madvise(a, size, MADV_POPULATE_WRITE);
+#endif
+	return a;
+}
+
+/* room for a body of len bytes and a NUL. with -M a big one gets its own
+ * mapping, faulted in up front rather than a page at a time by read(): on
+ * huge pages from the hugetlb pool if one is reserved, else transparent
+ * ones, so workers serving the same bytes miss the TLB far less. */
+static char *body_alloc(struct entry *e, size_t len)
+{
+	size_t size = len + 1;
+	char *p;
+
+	e->map_len = 0;
+	if (!mapstore_fl || size < STORE_MAP_MIN)
+		return calloc(1, size);
+	if (size < STORE_HUGE) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANON | MAP_POPULATE, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		e->map_len = size;
+		return p;
+	}
+	size = (size + STORE_HUGE - 1) & ~(size_t)(STORE_HUGE - 1);
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (p != MAP_FAILED) {
+		e->map_len = size;
+		return p;
+	}
+#endif
+	p = store_map_huge(size);
+	if (p)
+		e->map_len = size;
+	return p;
+}
+
+static void body_free(struct entry *e)
+{
+	if (e->map_len)
+		munmap(e->msg, e->map_len);
+	else
+		free(e->msg);
+	e->msg = NULL;
+	e->map_len = 0;
+}
+
+/* keep c's bodies and headers, and the table to find them, in memory so
+ * that none of it is paged out under pressure. heap pieces stay locked
+ * once freed, for the next snapshot to use. */
+static void content_lock(struct content *c)
+{
+	unsigned i;
+	int j;
+	int e = 0;
+
+	if (!mlock_fl)
+		return;
+	for (i = 0; i < c->nentries && !e; i++) {
+		const struct entry *en = &c->entries[i];
+
+		if (en->msg_len)
+			e = mlock(en->msg, en->msg_len);
+		for (j = 0; j < NR_VARIANTS && !e; j++)
+			if (en->variants[j].body_len)
+				e = mlock(en->variants[j].body,
+					en->variants[j].body_len);
+	}
+	if (!e && c->nentries)
+		e = mlock(c->entries, c->nentries * sizeof(*c->entries));
+	if (!e && c->routes)
+		e = mlock(c->routes, (c->route_mask + 1) * sizeof(*c->routes));
+	if (e)
+		log_info("mlock():%s, the content can be paged out\n",
+			strerror(errno));
+}
+
+static void entry_free(struct entry *e)
+{
+	int i;
+
+	for (i = 0; i < NR_VARIANTS; i++)
+		free(e->variants[i].body);
+	body_free(e);
+	if (e->msg_fd != -1)
+		close(e->msg_fd);
+	free(e->path);
+}
+
+static void content_put(struct content *c)
+{
+	unsigned i;
+
+	assert(c->refs > 0);
+	if (--c->refs)
+		return;
+	log_debug("freeing content %p\n", c);
+	for (i = 0; i < c->nentries; i++)
+		entry_free(&c->entries[i]);
+	free(c->entries);
+	free(c->routes);
+	free(c);
+}
+
+/* FNV-1a, short paths hash well enough with it */
+static uint32_t path_hash(const char *path, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* what to answer a request-target with, NULL if there's nothing there */
+static const struct entry *content_lookup(const struct content *c,
+	const char *target, size_t len)
+{
+	const struct route *r;
+	uint32_t h;
+	unsigned i;
+
+	if (!c->routes)
+		return &c->entries[0];
+	h = path_hash(target, len);
+	for (i = h & c->route_mask; (r = &c->routes[i])->key;
+		i = (i + 1) & c->route_mask)
+		if (r->hash == h && r->key_len == len &&
+			!memcmp(r->key, target, len))
+			return r->entry;
+	return NULL;
+}
+
+/**** HPACK ****/
+
+/* HTTP/2 header compression, RFC 7541. our headers are encoded once with
+ * the rest of an entry, as literals that stay out of the peer's dynamic
+ * table, so a reply is still a memcpy(). only requests get decoded. */
+#define H2_TABLE 4096 /* SETTINGS_HEADER_TABLE_SIZE, left at the default */
+
+static const struct hpack_field {
+	const char *name, *value;
+} hpack_static[] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+	{ ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+	{ ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+	{ ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" },
+	{ "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+	{ "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" },
+	{ "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" },
+	{ "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+	{ "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" },
+	{ "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" },
+	{ "proxy-authenticate", "" }, { "proxy-authorization", "" },
+	{ "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+	{ "strict-transport-security", "" }, { "transfer-encoding", "" },
+	{ "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" },
+};
+#define HPACK_STATIC (sizeof(hpack_static) / sizeof(*hpack_static))
+#define HPACK_DATE 33 /* index of "date" */
+
+/* the Huffman code is canonical, codes of each length are handed out in
+ * symbol order, so the length of each code is all there is to store */
+static const unsigned char huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+#define HUFF_EOS 256
+#define HUFF_MAXLEN 30
+
+/* per length, the first code, how many there are and where their
+ * symbols start in huff_sym[] */
+static uint32_t huff_first[HUFF_MAXLEN + 1];
+static unsigned huff_count[HUFF_MAXLEN + 1];
+static unsigned huff_index[HUFF_MAXLEN + 1];
+static unsigned short huff_sym[257];
+
+static void hpack_init(void)
+{
+	uint32_t code = 0;
+	unsigned len, sym, n = 0;
+
+	for (sym = 0; sym <= HUFF_EOS; sym++)
+		huff_count[huff_len[sym]]++;
+	for (len = 1; len <= HUFF_MAXLEN; len++) {
+		huff_first[len] = code;
+		huff_index[len] = n;
+		for (sym = 0; sym <= HUFF_EOS; sym++)
+			if (huff_len[sym] == len)
+				huff_sym[n++] = sym;
+		code = (code + huff_count[len]) << 1;
+	}
+}
+
+/* decode n bytes into buf, keeping up to size of them. *len is how long
+ * the string really is. -1 if it isn't valid Huffman. */
+static int huff_decode(const unsigned char *p, size_t n, char *buf,
+	size_t size, size_t *len)
+{
+	uint32_t code = 0;
+	unsigned bits = 0, b;
+	size_t out = 0;
+
+	while (n--) {
+		for (b = 0x80; b; b >>= 1) {
+			code = code << 1 | !!(*p & b);
+			bits++;
+			if (code - huff_first[bits] < huff_count[bits]) {
+				unsigned sym = huff_sym[huff_index[bits] +
+					code - huff_first[bits]];
+
+				if (sym == HUFF_EOS)
+					return -1;
+				if (out < size)
+					buf[out] = sym;
+				out++;
+				code = 0;
+				bits = 0;
+			} else if (bits == HUFF_MAXLEN) {
+				return -1;
+			}
+		}
+		p++;
+	}
+	/* padded out to a byte with the start of EOS, all ones */
+	if (bits > 7 || code != (1u << bits) - 1)
+		return -1;
+	*len = out;
+	return 0;
+}
+
+/* an integer with an n bit prefix, NULL if it runs off the end */
+static const unsigned char *hpack_int(const unsigned char *p,
+	const unsigned char *end, int n, size_t *value)
+{
+	size_t mask = (1u << n) - 1, v;
+	int shift = 0;
+
+	if (p == end)
+		return NULL;
+	v = *p++ & mask;
+	if (v == mask) {
+		do {
+			if (p == end || shift > 21)
+				return NULL; /* nothing we take is that big */
+			v += (size_t)(*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+	}
+	*value = v;
+	return p;
+}
+
+static char *hpack_put_int(char *p, unsigned first, int n, size_t value)
+{
+	size_t mask = (1u << n) - 1;
+
+	if (value < mask) {
+		*p++ = first | value;
+		return p;
+	}
+	*p++ = first | mask;
+	for (value -= mask; value >= 0x80; value >>= 7)
+		*p++ = 0x80 | (value & 0x7f);
+	*p++ = value;
+	return p;
+}
+
+/* a string literal, into buf as far as size allows */
+static const unsigned char *hpack_string(const unsigned char *p,
+	const unsigned char *end, char *buf, size_t size, size_t *len)
+{
+	int huff;
+	size_t n;
+
+	if (p == end)
+		return NULL;
+	huff = *p & 0x80;
+	p = hpack_int(p, end, 7, &n);
+	if (!p || n > (size_t)(end - p))
+		return NULL;
+	if (huff) {
+		if (huff_decode(p, n, buf, size, len))
+			return NULL;
+	} else {
+		memcpy(buf, p, n < size ? n : size);
+		*len = n;
+	}
+	return p + n;
+}
+
+/* turn one of our HTTP/1.1 headers into a header block. the status is
+ * indexed if the static table has it, and the rest are literals without
+ * indexing, which leave the decoder's dynamic table alone. date_h2 is
+ * appended as the block goes out. */
+static size_t hpack_encode(char *buf, size_t size, const char *hdr,
+	size_t len)
+{
+	const char *end = hdr + len, *line, *eol, *colon, *value;
+	char *p = buf;
+	size_t n, i;
+
+	assert(len > 12 && !memcmp(hdr, "HTTP/1.1 ", 9));
+	for (i = 8; i < 15; i++)
+		if (!memcmp(hpack_static[i - 1].value, hdr + 9, 3))
+			break;
+	if (i < 15) {
+		*p++ = 0x80 | i;
+	} else {
+		*p++ = 0x08; /* name of :status, without indexing */
+		*p++ = 3;
+		memcpy(p, hdr + 9, 3);
+		p += 3;
+	}
+	for (line = memchr(hdr, '\n', len) + 1; line < end; line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol || eol - line < 2)
+			break; /* the blank line */
+		colon = memchr(line, ':', eol - line);
+		if (!colon)
+			continue;
+		n = colon - line;
+		value = colon + 1;
+		while (*value == ' ')
+			value++;
+		/* connection specific, meaningless in HTTP/2 */
+		if (n == 10 && !strncasecmp(line, "Connection", 10))
+			continue;
+		if ((size_t)(p - buf) + n + (eol - value) + 16 > size)
+			perror_and_die("hpack_encode()");
+		for (i = 15; i <= HPACK_STATIC; i++)
+			if (strlen(hpack_static[i - 1].name) == n &&
+				!strncasecmp(hpack_static[i - 1].name, line, n))
+				break;
+		if (i <= HPACK_STATIC) {
+			p = hpack_put_int(p, 0x00, 4, i);
+		} else {
+			*p++ = 0x00;
+			p = hpack_put_int(p, 0x00, 7, n);
+			for (i = 0; i < n; i++)
+				*p++ = tolower((unsigned char)line[i]);
+		}
+		n = eol - value - (eol[-1] == '\r');
+		p = hpack_put_int(p, 0x00, 7, n);
+		memcpy(p, value, n);
+		p += n;
+	}
+	return p - buf;
+}
+
+/* the decoder's dynamic table, newest entry last */
+struct hpack {
+	size_t size; /* as RFC 7541 counts it, 32 bytes extra per entry */
+	size_t max;
+	unsigned n;
+	struct {
+		unsigned short ofs, name_len, value_len;
+	} ent[H2_TABLE / 32];
+	size_t used; /* bytes of data[] */
+	char data[H2_TABLE];
+};
+
+static void hpack_evict(struct hpack *t, size_t max)
+{
+	while (t->n && t->size > max) {
+		size_t len = t->ent[0].name_len + t->ent[0].value_len;
+		unsigned i;
+
+		memmove(t->data, t->data + len, t->used - len);
+		t->used -= len;
+		t->size -= len + 32;
+		t->n--;
+		memmove(t->ent, t->ent + 1, t->n * sizeof(*t->ent));
+		for (i = 0; i < t->n; i++)
+			t->ent[i].ofs -= len;
+	}
+}
+
+static void hpack_insert(struct hpack *t, const char *name, size_t nlen,
+	const char *value, size_t vlen)
+{
+	size_t len = nlen + vlen;
+
+	/* one that doesn't fit empties the table */
+	hpack_evict(t, len + 32 > t->max ? 0 : t->max - len - 32);
+	if (len + 32 > t->max)
+		return;
+	t->ent[t->n].ofs = t->used;
+	t->ent[t->n].name_len = nlen;
+	t->ent[t->n].value_len = vlen;
+	t->n++;
+	memcpy(t->data + t->used, name, nlen);
+	memcpy(t->data + t->used + nlen, value, vlen);
+	t->used += len;
+	t->size += len + 32;
+}
+
+/* look up an index, name and value point at the table */
+static int hpack_field(const struct hpack *t, size_t idx, const char **name,
+	size_t *nlen, const char **value, size_t *vlen)
+{
+	if (!idx)
+		return -1;
+	if (idx <= HPACK_STATIC) {
+		*name = hpack_static[idx - 1].name;
+		*nlen = strlen(*name);
+		*value = hpack_static[idx - 1].value;
+		*vlen = strlen(*value);
+		return 0;
+	}
+	idx -= HPACK_STATIC + 1;
+	if (idx >= t->n)
+		return -1;
+	idx = t->n - 1 - idx;
+	*name = t->data + t->ent[idx].ofs;
+	*nlen = t->ent[idx].name_len;
+	*value = *name + *nlen;
+	*vlen = t->ent[idx].value_len;
+	return 0;
+}
+
+/* decode a header block, calling fn for each field. a name or value
+ * longer than the table is cut short, it couldn't be indexed anyway.
+ * -1 on a COMPRESSION_ERROR. */
+static int hpack_decode(struct hpack *t, const unsigned char *p,
+	size_t len, void (*fn)(void *, const char *, size_t, const char *,
+	size_t), void *arg)
+{
+	static char nbuf[H2_TABLE], vbuf[H2_TABLE];
+	const unsigned char *end = p + len;
+
+	while (p < end) {
+		const char *name, *value;
+		size_t idx, nlen, vlen;
+		int n, index;
+
+		if (*p & 0x80) { /* indexed */
+			p = hpack_int(p, end, 7, &idx);
+			if (!p || hpack_field(t, idx, &name, &nlen, &value,
+				&vlen))
+				return -1;
+			fn(arg, name, nlen, value, vlen);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) { /* dynamic table size update */
+			p = hpack_int(p, end, 5, &idx);
+			if (!p || idx > H2_TABLE)
+				return -1;
+			t->max = idx;
+			hpack_evict(t, t->max);
+			continue;
+		}
+		/* a literal, with incremental indexing or not */
+		index = (*p & 0xc0) == 0x40;
+		n = index ? 6 : 4;
+		p = hpack_int(p, end, n, &idx);
+		if (!p)
+			return -1;
+		if (idx) {
+			if (hpack_field(t, idx, &name, &nlen, &value, &vlen))
+				return -1;
+			/* copied, inserting may move it */
+			memcpy(nbuf, name, nlen);
+		} else {
+			p = hpack_string(p, end, nbuf, sizeof(nbuf), &nlen);
+			if (!p)
+				return -1;
+		}
+		p = hpack_string(p, end, vbuf, sizeof(vbuf), &vlen);
+		if (!p)
+			return -1;
+		if (nlen > sizeof(nbuf) || vlen > sizeof(vbuf)) {
+			if (index)
+				hpack_evict(t, 0);
+			nlen = nlen < sizeof(nbuf) ? nlen : sizeof(nbuf);
+			vlen = vlen < sizeof(vbuf) ? vlen : sizeof(vbuf);
+			index = 0;
+		}
+		fn(arg, nbuf, nlen, vbuf, vlen);
+		if (index)
+			hpack_insert(t, nbuf, nlen, vbuf, vlen);
+	}
+	return 0;
+}
+
+/* error replies, the same for every snapshot */
+static struct entry not_found, not_allowed, bad_request, timed_out,
+	uri_too_long, fields_too_large, unavailable;
+
+static void canned_init(struct entry *e, const char *status,
+	const char *extra)
+{
+	int len;
+
+	e->msg_fd = -1;
+	len = asprintf(&e->msg, "<html><body><h1>%s</h1></body></html>\n",
+		status);
+	if (len < 0)
+		perror_and_die("asprintf()");
+	e->msg_len = len;
+	len = snprintf(e->hdr, sizeof(e->hdr),
+		"HTTP/1.1 %s\r\n"
+		"Content-Type: text/html; charset=UTF-8\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"\r\n", status, e->msg_len, extra);
+	if (len < 0 || (size_t)len >= sizeof(e->hdr))
+		perror_and_die("snprintf()");
+	e->hdr_len = len;
+	e->h2hdr_len = hpack_encode(e->h2hdr, sizeof(e->h2hdr), e->hdr,
+		e->hdr_len);
+}
+
+/**** Date header ****/
+
+/* called when the loop wakes up, the date is formatted once a second and
+ * copied into each reply as it is queued */
+static void date_tick(time_t now)
+{
+	if (now == date_when)
+		return;
+	date_when = now;
+	strftime(date_now, sizeof(date_now), "%a, %d %b %Y %T GMT",
+		gmtime(&now));
+	snprintf(date_line, sizeof(date_line), "Date: %s\r\n\r\n", date_now);
+	memcpy(date_h2, "\x0f\x12\x1d", 3);
+	memcpy(date_h2 + 3, date_now, DATE_LEN);
+}
+
+/**** client pool ****/
+
+/* each worker allocates its own pool once, after fork() */
+static void pool_init(void)
+{
+	unsigned i;
+	int e;
+
+	e = posix_memalign((void**)&client_pool, CACHE_LINE,
+		(size_t)pool_size * sizeof(*client_pool));
+	if (e) {
+		errno = e;
+		perror_and_die("client pool");
+	}
+	client_free_list = NULL;
+	for (i = pool_size; i-- > 0; ) {
+		client_pool[i].fd = -1;
+		client_pool[i].next = client_free_list;
+		client_free_list = &client_pool[i];
+	}
+	pool_used = 0;
+	pool_high = 0;
+}
+
+static struct client *pool_get(void)
+{
+	struct client *cl = client_free_list;
+
+	if (!cl)
+		return NULL;
+	client_free_list = cl->next;
+	memset(cl, 0, offsetof(struct client, replies));
+	pool_used++;
+	STAT_SET(clients, pool_used);
+	/* report each time the high-water mark doubles, and when full */
+	if (pool_used > pool_high) {
+		pool_high = pool_used;
+		if (!(pool_high & (pool_high - 1)) || pool_high == pool_size)
+			log_info("client pool high-water mark %u of %u\n",
+				pool_high, pool_size);
+	}
+	return cl;
+}
+
+static void pool_put(struct client *cl)
+{
+	assert(cl >= client_pool && cl < client_pool + pool_size);
+	assert(pool_used > 0);
+	cl->fd = -1;
+	cl->next = client_free_list;
+	client_free_list = cl;
+	pool_used--;
+	STAT_SET(clients, pool_used);
+}
+
+/**** connections per address ****/
+
+/* open addressed with linear probing, at most pool_size addresses in
+ * twice as many slots. removal shifts the rest of the run back, so there
+ * are no tombstones to clean up. */
+struct peer {
+	struct in6_addr addr; /* from peer_key() */
+	unsigned count; /* 0 for an empty slot */
+};
+
+static struct peer *peer_table;
+static unsigned peer_mask;
+static unsigned peer_shift; /* the top bits of the hash pick the slot */
+
+static void peer_init(void)
+{
+	unsigned n = 2;
+
+	if (!peer_limit)
+		return;
+	peer_shift = 31;
+	while (n < pool_size * 2) {
+		n *= 2;
+		peer_shift--;
+	}
+	peer_table = calloc(n, sizeof(*peer_table));
+	if (!peer_table)
+		perror_and_die("calloc()");
+	peer_mask = n - 1;
+}
+
+/* what a peer is counted as: an IPv4 address as the v4 mapped IPv6 one,
+ * and an IPv6 address by its /64, since that is what one host is usually
+ * given. 0 for a Unix socket, all of whose clients are the local proxy. */
+static int peer_key(const union peer_addr *pa, struct in6_addr *key)
+{
+	memset(key, 0, sizeof(*key));
+	switch (pa->sa.sa_family) {
+	case AF_INET:
+		key->s6_addr[10] = key->s6_addr[11] = 0xff;
+		memcpy(key->s6_addr + 12, &pa->sin.sin_addr, 4);
+		return 1;
+	case AF_INET6:
+		memcpy(key->s6_addr, pa->sin6.sin6_addr.s6_addr, 8);
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned peer_hash(const struct in6_addr *key)
+{
+	uint64_t hi, lo;
+
+	memcpy(&hi, key->s6_addr, 8);
+	memcpy(&lo, key->s6_addr + 8, 8);
+	hi = (hi * 0x9e3779b97f4a7c15ull) ^ lo;
+	return (hi * 0x9e3779b97f4a7c15ull) >> (32 + peer_shift);
+}
+
+/* the slot holding key, or the empty one where it would go */
+static struct peer *peer_find(const struct in6_addr *key)
+{
+	unsigned i = peer_hash(key);
+
+	while (peer_table[i].count &&
+		memcmp(&peer_table[i].addr, key, sizeof(*key)))
+		i = (i + 1) & peer_mask;
+	return &peer_table[i];
+}
+
+/* count a connection from pa, 0 if it already has peer_limit */
+static int peer_add(const union peer_addr *pa)
+{
+	struct in6_addr key;
+	struct peer *p;
+
+	if (!peer_limit || !peer_key(pa, &key))
+		return 1;
+	p = peer_find(&key);
+	if (p->count >= peer_limit)
+		return 0;
+	p->addr = key;
+	p->count++;
+	return 1;
+}
+
+static void peer_del(const union peer_addr *pa)
+{
+	struct in6_addr key;
+	unsigned i, j, home;
+
+	if (!peer_limit || !peer_key(pa, &key))
+		return;
+	i = peer_find(&key) - peer_table;
+	assert(peer_table[i].count > 0);
+	if (--peer_table[i].count)
+		return;
+	/* fill the hole with anything later in the run that may live here */
+	for (j = (i + 1) & peer_mask; peer_table[j].count;
+			j = (j + 1) & peer_mask) {
+		home = peer_hash(&peer_table[j].addr);
+		if (((j - home) & peer_mask) >= ((j - i) & peer_mask)) {
+			peer_table[i] = peer_table[j];
+			peer_table[j].count = 0;
+			i = j;
+		}
+	}
+}
+
+/**** timeouts ****/
+
+/* two level timing wheel with one second ticks. level 0 holds deadlines
+ * in the next 64 seconds, level 1 the next 64 * 63, and anything further
+ * out is put at the end of level 1 and checked again. a bit per non-empty
+ * slot makes finding the next deadline a count of trailing zeros. */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+static struct client *wheel[2][WHEEL_SIZE];
+static uint64_t wheel_used[2];
+static time_t wheel_now; /* every tick up to this one has been processed */
+
+/* a reader has to get the whole request within header_timeout of when
+ * it started waiting for it, activity only extends the read timeout.
+ * header_timeout is never less than read_timeout, so neither can move a
+ * deadline earlier than the slot it was put in. */
+static time_t client_deadline(const struct client *cl)
+{
+	time_t deadline;
+
+	if (cl->flags & CL_LINGER)
+		return cl->begin + HTTP_LINGER;
+	if (cl->flags & CL_IDLE)
+		return cl->last + idle_timeout;
+	deadline = cl->last + read_timeout;
+	if (!cl->nreplies && deadline > cl->begin + header_timeout)
+		deadline = cl->begin + header_timeout;
+	return deadline;
+}
+
+static void timer_unlink(struct client *cl)
+{
+	int level = cl->tslot >> WHEEL_BITS;
+	int idx = cl->tslot & WHEEL_MASK;
+
+	if (!cl->tprev)
+		return;
+	*cl->tprev = cl->tnext;
+	if (cl->tnext)
+		cl->tnext->tprev = cl->tprev;
+	cl->tnext = NULL;
+	cl->tprev = NULL;
+	if (!wheel[level][idx])
+		wheel_used[level] &= ~(1ull << idx);
+}
+
+/* soonest is the first tick whose slot is still to be processed, what is
+ * already due goes there */
+static void timer_insert(struct client *cl, time_t when, time_t soonest)
+{
+	struct client **slot;
+	time_t delta = when - wheel_now;
+	int level, idx;
+
+	assert(cl->tprev == NULL);
+	if (when < soonest)
+		delta = soonest - wheel_now;
+	if (delta < WHEEL_SIZE) {
+		level = 0;
+		idx = (wheel_now + delta) & WHEEL_MASK;
+	} else {
+		if (delta > WHEEL_SIZE * (WHEEL_SIZE - 1))
+			delta = WHEEL_SIZE * (WHEEL_SIZE - 1);
+		level = 1;
+		idx = ((wheel_now + delta) >> WHEEL_BITS) & WHEEL_MASK;
+	}
+	slot = &wheel[level][idx];
+	cl->tslot = (level << WHEEL_BITS) | idx;
+	cl->tnext = *slot;
+	if (cl->tnext)
+		cl->tnext->tprev = &cl->tnext;
+	cl->tprev = slot;
+	*slot = cl;
+	wheel_used[level] |= 1ull << idx;
+}
+
+/* (re)schedule a client for its current timeout. activity only updates
+ * cl->last, a client whose deadline moved out is re-inserted when its old
+ * slot comes up. only a shorter timeout has to call this. */
+static void timer_arm(struct client *cl)
+{
+	timer_unlink(cl);
+	timer_insert(cl, client_deadline(cl), wheel_now + 1);
+}
+
+static void client_free(struct client *cl);
+
+static int client_plain(const struct client *cl);
+static int client_reject(struct client *cl, const struct entry *e);
+
+static void timer_expire(time_t now)
+{
+	struct client *cl;
+
+	while (wheel_now < now) {
+		if (!wheel_used[0] && !wheel_used[1]) {
+			wheel_now = now; /* nothing to do, skip ahead */
+			break;
+		}
+		wheel_now++;
+		if (!(wheel_now & WHEEL_MASK)) {
+			/* move the next 64 seconds down to level 0, what is
+			 * due now into the slot about to be expired */
+			int idx = (wheel_now >> WHEEL_BITS) & WHEEL_MASK;
+
+			while ((cl = wheel[1][idx])) {
+				timer_unlink(cl);
+				timer_insert(cl, client_deadline(cl), wheel_now);
+			}
+		}
+		while ((cl = wheel[0][wheel_now & WHEEL_MASK])) {
+			time_t deadline = client_deadline(cl);
+
+			timer_unlink(cl);
+			if (deadline > wheel_now) {
+				/* had activity */
+				timer_insert(cl, deadline, wheel_now + 1);
+				continue;
+			}
+			log_debug("closing fd %d, timeout\n", cl->fd);
+			STAT_ADD(timeouts, 1);
+			/* part way through a request, say why it is closed */
+			if (!(cl->flags & (CL_IDLE | CL_LINGER | CL_HANDSHAKE)) &&
+				!cl->h2 && !cl->nreplies && client_plain(cl) &&
+				(cl->in_len || cl->state != PARSE_REQUEST) &&
+				client_reject(cl, &timed_out))
+				continue;
+			client_free(cl);
+		}
+	}
+}
+
+/* milliseconds until timer_expire() has something to do, -1 for never */
+static int timer_next_ms(time_t now)
+{
+	time_t next;
+
+	if (wheel_used[0]) {
+		unsigned shift = (wheel_now + 1) & WHEEL_MASK;
+		uint64_t rot = wheel_used[0] >> shift;
+
+		if (shift)
+			rot |= wheel_used[0] << (WHEEL_SIZE - shift);
+		next = wheel_now + 1 + __builtin_ctzll(rot);
+	} else if (wheel_used[1]) {
+		next = ((wheel_now >> WHEEL_BITS) + 1) << WHEEL_BITS;
+	} else {
+		return -1;
+	}
+	return next <= now ? 0 : (next - now) * 1000;
+}
+
+/**** clients ****/
+
+#ifdef HAVE_OPENSSL
+static void tls_close(struct client *cl);
+static int tls_start(struct client *cl);
+#endif
+/* what a client starts an HTTP/2 connection with */
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define H2_PREFACE_LEN (sizeof(h2_preface) - 1)
+static int h2_start(struct client *cl, unsigned preface);
+static int h2_ready(struct client *cl, int events);
+static void h2_free(struct client *cl);
+
+/* make room in the connection table for fd */
+static int conn_grow(int fd)
+{
+	int n = conn_len ? conn_len : 64;
+	struct client **cp;
+	unsigned char *sp;
+	time_t *tp;
+
+	while (n <= fd)
+		n *= 2;
+	/* conn_len only changes once all of them have grown */
+	cp = realloc(conn_client, n * sizeof(*cp));
+	if (!cp)
+		return -1;
+	conn_client = cp;
+	sp = realloc(conn_state, n * sizeof(*sp));
+	if (!sp)
+		return -1;
+	conn_state = sp;
+	tp = realloc(conn_since, n * sizeof(*tp));
+	if (!tp)
+		return -1;
+	conn_since = tp;
+	memset(conn_client + conn_len, 0, (n - conn_len) * sizeof(*cp));
+	memset(conn_state + conn_len, CONN_FREE, (n - conn_len) * sizeof(*sp));
+	memset(conn_since + conn_len, 0, (n - conn_len) * sizeof(*tp));
+	conn_len = n;
+	return 0;
+}
+
+static void paced_unlink(struct client *cl)
+{
+	assert(cl->prev != NULL);
+	if (paced_tail == &cl->next)
+		paced_tail = cl->prev;
+	*cl->prev = cl->next;
+	if (cl->next)
+		cl->next->prev = cl->prev;
+	cl->next = NULL;
+	cl->prev = NULL;
+}
+
+/* change the event interest of a client, 0 to remove it entirely */
+static int client_events(struct client *cl, int events)
+{
+	int e;
+
+	e = ev->set(cl->fd, cl->events, events);
+	if (!e)
+		cl->events = events;
+	return e;
+}
+
+/* move a client to another state, with the interest that goes with it */
+static int client_set(struct client *cl, int state, int events)
+{
+	if (cl->events != events && client_events(cl, events))
+		return 0;
+	conn_state[cl->fd] = state;
+	return 1;
+}
+
+static void client_free(struct client *cl)
+{
+	unsigned i;
+
+	assert(cl != NULL);
+	assert(cl->fd != -1);
+	for (i = 0; i < cl->nreplies; i++)
+		content_put(cl->replies[i].content);
+	cl->nreplies = 0;
+	if (cl->content)
+		content_put(cl->content);
+	if (conn_state[cl->fd] == CONN_PACED)
+		paced_unlink(cl);
+	timer_unlink(cl);
+#ifdef HAVE_OPENSSL
+	if (cl->ssl)
+		tls_close(cl);
+#endif
+	if (cl->h2)
+		h2_free(cl);
+	log_debug("freeing client fd %d (%p)\n", cl->fd, cl);
+	client_events(cl, 0);
+	conn_client[cl->fd] = NULL;
+	conn_state[cl->fd] = CONN_FREE;
+	while (conn_top > 0 && conn_state[conn_top - 1] == CONN_FREE)
+		conn_top--;
+	close(cl->fd);
+	peer_del(&cl->peer);
+	pool_put(cl);
+}
+
+/* out of clients or descriptors, close the reader that has been waiting
+ * longest, keep-alive connections between requests before ones part way
+ * through a request. writers are left alone. 0 if there was none. */
+static int client_shed(void)
+{
+	int fd, victim = -1;
+
+	for (fd = 0; fd < conn_top; fd++) {
+		int state = conn_state[fd];
+
+		if (state != CONN_READ && state != CONN_IDLE)
+			continue;
+		/* CONN_IDLE sorts above CONN_READ */
+		if (victim < 0 || state > conn_state[victim] ||
+			(state == conn_state[victim] &&
+			conn_since[fd] < conn_since[victim]))
+			victim = fd;
+	}
+	if (victim < 0)
+		return 0;
+	log_debug("closing fd %d, shed\n", victim);
+	STAT_ADD(shed, 1);
+	client_free(conn_client[victim]);
+	return 1;
+}
+
+/* accept a connection as a non-blocking, close-on-exec socket */
+static int accept_nonblock(int fd, struct sockaddr_storage *ss)
+{
+	socklen_t len = sizeof(*ss);
+	int newfd;
+
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__) || defined(__DragonFly__)
+	newfd = accept4(fd, (struct sockaddr*)ss, &len,
+		SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	newfd = accept(fd, (struct sockaddr*)ss, &len);
+	if (newfd >= 0 && (fcntl(newfd, F_SETFL, O_NONBLOCK) ||
+			fcntl(newfd, F_SETFD, FD_CLOEXEC))) {
+		close(newfd);
+		return -1;
+	}
+#endif
+	return newfd;
+}
+
+/* replies go out whole, as soon as they are written, so Nagle only ever
+ * holds back the tail of a pipelined batch until the client's delayed ACK */
+static void client_sockopts(int fd, int family)
+{
+	int op = 1;
+
+	if (sndbuf)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	if (family == AF_UNIX)
+		return;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &op, sizeof(op));
+#ifdef TCP_NOTSENT_LOWAT
+	if (notsent_lowat)
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat,
+			sizeof(notsent_lowat));
+#endif
+}
+
+/* over the per-address limit: reset it rather than spend any more on a
+ * peer that is already holding its share */
+static void client_drop(int fd)
+{
+	struct linger lg = { 1, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(fd);
+}
+
+/* no room for a connection. a plain one gets a 503 first, then it is
+ * closed right away: this doesn't linger like client_reject(), there is no
+ * client to do it with. what has already arrived is read, but anything
+ * later turns the close into a reset that can take the 503 with it. */
+static void client_refuse(int fd, int tls)
+{
+	char buf[HTTP_BUFSIZE];
+	struct iovec iov[3];
+	int i;
+
+	if (!tls) {
+		iov[0].iov_base = unavailable.hdr;
+		iov[0].iov_len = unavailable.hdr_len - 2;
+		iov[1].iov_base = date_line;
+		iov[1].iov_len = DATE_LINE_LEN;
+		iov[2].iov_base = unavailable.msg;
+		iov[2].iov_len = unavailable.msg_len;
+		if (writev(fd, iov, 3) > 0 && !shutdown(fd, SHUT_WR))
+			for (i = 0; i < 4 && read(fd, buf, sizeof(buf)) > 0;
+				i++)
+				;
+		STAT_ADD(rejected, 1);
+	}
+	close(fd);
+}
+
+static void client_add(int newfd, const struct sockaddr_storage *ss, int tls)
+{
+	union peer_addr pa;
+	struct client *new;
+
+	if (newfd >= conn_len && conn_grow(newfd)) {
+		log_info("closing fd %d:%s\n", newfd, strerror(errno));
+		close(newfd);
+		return;
+	}
+	memcpy(&pa, ss, sizeof(pa));
+	if (!peer_add(&pa)) {
+		log_debug("closing fd %d:too many from one address\n", newfd);
+		STAT_ADD(refused, 1);
+		client_drop(newfd);
+		return;
+	}
+	new = pool_get();
+	if (!new && client_shed())
+		new = pool_get();
+	if (!new) {
+		log_info("closing fd %d:client pool exhausted\n", newfd);
+		client_refuse(newfd, tls);
+		peer_del(&pa);
+		return;
+	}
+	log_debug("new client fd %d\n", newfd);
+	client_sockopts(newfd, pa.sa.sa_family);
+	new->fd = newfd;
+	new->peer = pa;
+	if (client_events(new, EV_READ)) {
+		log_info("closing fd %d:%s\n", newfd, strerror(errno));
+		close(newfd);
+		peer_del(&pa);
+		pool_put(new);
+		return;
+	}
+	new->last = loop_now;
+	new->begin = new->last;
+	new->tokens = pace_depth;
+	new->paced_at = loop_usec;
+	timer_arm(new);
+	conn_client[newfd] = new;
+	conn_state[newfd] = CONN_READ;
+	conn_since[newfd] = new->begin;
+	if (newfd >= conn_top)
+		conn_top = newfd + 1;
+#ifdef HAVE_OPENSSL
+	if (tls && tls_start(new)) {
+		log_info("closing fd %d:TLS setup failed\n", newfd);
+		client_free(new);
+	}
+#else
+	(void)tls;
+#endif
+}
+
+/* stop or resume watching the listeners of this worker */
+static void listeners_watch(int old_events, int new_events)
+{
+	struct listener *l;
+	int i;
+
+	for (l = listeners; l < listeners + nlisteners; l++)
+		for (i = 0; i < l->nfds; i++)
+			if (listener_mine(l, i))
+				ev->set(l->fds[i], old_events, new_events);
+}
+
+/* the backlog can't be taken from, and a listener left readable would wake
+ * us up straight away: leave it alone for a second */
+static void accept_pause(void)
+{
+	if (accept_paused)
+		return;
+	log_info("accept():%s, pausing for a second\n", strerror(errno));
+	listeners_watch(EV_READ, 0);
+	accept_paused = loop_usec + 1000000;
+}
+
+static void accept_resume(void)
+{
+	accept_paused = 0;
+	listeners_watch(0, EV_READ);
+}
+
+/* out of descriptors with no one to shed: give up the reserve to take the
+ * next connection off the backlog and refuse it. returns 0 if that can't
+ * be done, or the backlog is empty. */
+static int accept_reserve(int fd, int tls)
+{
+	struct sockaddr_storage ss;
+	int newfd, e;
+
+	if (reserve_fd == -1)
+		return 0;
+	close(reserve_fd);
+	newfd = accept_nonblock(fd, &ss);
+	e = errno;
+	if (newfd >= 0) {
+		STAT_ADD(accepts, 1);
+		log_debug("closing fd %d:out of descriptors\n", newfd);
+		client_refuse(newfd, tls);
+	}
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	errno = e;
+	return newfd >= 0;
+}
+
+/* drain the listen backlog, up to accept_budget connections per wakeup so
+ * a flood of new connections can't starve the ones we already have */
+static void client_accept(int fd, int tls)
+{
+	struct sockaddr_storage ss;
+	unsigned n;
+	int newfd;
+
+	for (n = 0; n < accept_budget; n++) {
+		newfd = accept_nonblock(fd, &ss);
+		if (newfd >= 0) {
+			STAT_ADD(accepts, 1);
+			client_add(newfd, &ss, tls);
+			continue;
+		}
+		switch (errno) {
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+			continue; /* that one went away, try the next */
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return; /* backlog is empty */
+		case EMFILE:
+		case ENFILE:
+			/* make room for it, or turn it away */
+			if (client_shed() || accept_reserve(fd, tls))
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			accept_pause();
+			return;
+		case ENOBUFS:
+		case ENOMEM:
+			/* out of resources, leave the rest in the backlog */
+			accept_pause();
+			return;
+		default:
+			perror_and_die("accept()");
+		}
+	}
+}
+
+/* send part of the body straight from the page cache */
+static ssize_t send_body(int fd, const struct entry *e, size_t ofs,
+	size_t len)
+{
+#if defined(__linux__)
+	off_t off = ofs;
+
+	if (e->msg_fd != -1)
+		return sendfile(fd, e->msg_fd, &off, len);
+#elif defined(HAVE_SENDFILE)
+	off_t sbytes = 0;
+
+	if (e->msg_fd != -1) {
+		if (sendfile(e->msg_fd, fd, ofs, len, NULL, &sbytes, 0) &&
+			!sbytes)
+			return -1;
+		return sbytes;
+	}
+#endif
+	return write(fd, e->msg + ofs, len);
+}
+
+/* the header of r as it goes out: the prebuilt one up to its blank line,
+ * then r->date. a pointer to it from ofs, *len bytes of which are in one
+ * piece. */
+static const char *reply_hdr(const struct reply *r, size_t ofs, size_t *len)
+{
+	size_t head = r->hdr_len - 2;
+
+	if (ofs < head) {
+		*len = head - ofs;
+		return r->hdr + ofs;
+	}
+	*len = head + DATE_LINE_LEN - ofs;
+	return r->date + (ofs - head);
+}
+
+static size_t reply_hdr_len(const struct reply *r)
+{
+	return r->hdr_len - 2 + DATE_LINE_LEN;
+}
+
+/* the rest of the header from ofs in iov, no more than *budget bytes of
+ * it. returns the number of iovecs, 2 at most. */
+static int reply_hdr_iov(const struct reply *r, size_t ofs, size_t *budget,
+	struct iovec *iov)
+{
+	size_t len;
+	int n = 0;
+
+	while (*budget && ofs < reply_hdr_len(r)) {
+		iov[n].iov_base = (char*)reply_hdr(r, ofs, &len);
+		if (len > *budget)
+			len = *budget;
+		iov[n++].iov_len = len;
+		ofs += len;
+		*budget -= len;
+	}
+	return n;
+}
+
+/* zero-copy: each header is corked with MSG_MORE until sendfile() supplies
+ * the body behind it, so small replies still leave in one segment. */
+static ssize_t send_replies_zc(struct client *cl, size_t budget)
+{
+	size_t ofs = cl->write_ofs;
+	ssize_t total = 0;
+	ssize_t res;
+	size_t len;
+	unsigned i;
+
+	for (i = 0; i < cl->nreplies; i++, ofs = 0) {
+		const struct reply *r = &cl->replies[i];
+		size_t hlen = reply_hdr_len(r);
+
+		if (ofs < hlen) {
+			struct iovec iov[2];
+			struct msghdr msg;
+			int more = 0;
+#ifdef MSG_MORE
+			if (r->body_len || i + 1 < cl->nreplies)
+				more = MSG_MORE;
+#endif
+			len = budget - total;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = reply_hdr_iov(r, ofs, &len, iov);
+			res = sendmsg(cl->fd, &msg, more);
+			if (res < 0)
+				return total ? total : res;
+			total += res;
+			if ((size_t)res < hlen - ofs)
+				return total;
+			ofs = hlen;
+		}
+		if (!r->body_len)
+			continue;
+		if ((size_t)total == budget)
+			return total;
+		len = r->body_len - (ofs - hlen);
+		if (len > budget - total)
+			len = budget - total;
+		if (r->from_file)
+			res = send_body(cl->fd, r->entry,
+				(r->body - r->entry->msg) + (ofs - hlen), len);
+		else /* a variant, only the file itself can use sendfile() */
+			res = send(cl->fd, r->body + (ofs - hlen), len, 0);
+		if (res < 0)
+			return total ? total : res;
+		total += res;
+		if ((size_t)res < r->body_len - (ofs - hlen))
+			return total;
+	}
+	return total;
+}
+
+/* send what is left of the queued replies in one writev(), so a small
+ * response or a batch of pipelined ones takes a single syscall. no more
+ * than budget bytes are offered. */
+static ssize_t send_replies(struct client *cl, size_t budget)
+{
+	struct iovec iov[3 * HTTP_PIPELINE];
+	size_t ofs = cl->write_ofs;
+	unsigned i;
+	int n = 0;
+
+	for (i = 0; i < cl->nreplies && budget; i++, ofs = 0) {
+		const struct reply *r = &cl->replies[i];
+
+		if (ofs < reply_hdr_len(r)) {
+			n += reply_hdr_iov(r, ofs, &budget, iov + n);
+			ofs = 0;
+		} else {
+			ofs -= reply_hdr_len(r);
+		}
+		if (ofs < r->body_len && budget) {
+			iov[n].iov_base = (char*)r->body + ofs;
+			iov[n].iov_len = r->body_len - ofs;
+			if (iov[n].iov_len > budget)
+				iov[n].iov_len = budget;
+			budget -= iov[n++].iov_len;
+		}
+	}
+	return writev(cl->fd, iov, n);
+}
+
+/* retire the replies that res bytes completed */
+static void replies_sent(struct client *cl, size_t res)
+{
+	unsigned done = 0;
+
+	res += cl->write_ofs;
+	while (done < cl->nreplies) {
+		const struct reply *r = &cl->replies[done];
+
+		if (res < reply_hdr_len(r) + r->body_len)
+			break;
+		res -= reply_hdr_len(r) + r->body_len;
+		content_put(r->content);
+		done++;
+	}
+	assert(done < cl->nreplies || !res);
+	cl->nreplies -= done;
+	memmove(cl->replies, cl->replies + done,
+		cl->nreplies * sizeof(*cl->replies));
+	cl->write_ofs = res;
+}
+
+static int client_resume(struct client *cl);
+
+#ifdef HAVE_OPENSSL
+/**** TLS ****/
+
+/* the context is made once before the workers are forked, so all of them
+ * have the same session ticket keys and a ticket issued by one resumes at
+ * any other. there is no per-process session cache to get out of step. */
+static SSL_CTX *tls_ctx;
+
+static void tls_die(const char *reason)
+{
+	fprintf(stderr, "%s:", reason);
+	ERR_print_errors_fp(stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* h2 when the client offers it, otherwise HTTP/1.1 */
+static int tls_alpn(SSL *ssl __attribute__((unused)),
+	const unsigned char **out, unsigned char *outlen,
+	const unsigned char *in, unsigned inlen,
+	void *arg __attribute__((unused)))
+{
+	static const unsigned char protos[] = "\2h2\10http/1.1";
+
+	if (SSL_select_next_proto((unsigned char**)out, outlen, protos,
+		sizeof(protos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static void tls_init(const char *cert, const char *key)
+{
+	long opts = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* hand the record layer to the kernel after the handshake where it
+	 * can, so write() and sendfile() on the socket are encrypted there */
+	opts |= SSL_OP_ENABLE_KTLS;
+#endif
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (!tls_ctx)
+		tls_die("SSL_CTX_new()");
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(tls_ctx, opts);
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_num_tickets(tls_ctx, 1);
+	SSL_CTX_set_alpn_select_cb(tls_ctx, tls_alpn, NULL);
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1)
+		tls_die(cert);
+	if (SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1)
+		tls_die(key);
+	if (SSL_CTX_check_private_key(tls_ctx) != 1)
+		tls_die(key);
+}
+
+static int tls_start(struct client *cl)
+{
+	cl->ssl = SSL_new(tls_ctx);
+	if (!cl->ssl || !SSL_set_fd(cl->ssl, cl->fd)) {
+		ERR_clear_error();
+		return -1;
+	}
+	SSL_set_accept_state(cl->ssl);
+	cl->flags |= CL_HANDSHAKE;
+	return 0;
+}
+
+/* a close_notify if we got that far, the socket is closed anyway */
+static void tls_close(struct client *cl)
+{
+	if (!(cl->flags & CL_HANDSHAKE))
+		SSL_shutdown(cl->ssl);
+	SSL_free(cl->ssl);
+	cl->ssl = NULL;
+	ERR_clear_error();
+}
+
+/* turn the result of an SSL_read() or SSL_write() into what read() and
+ * write() would have said */
+static ssize_t tls_result(struct client *cl, int res)
+{
+	if (res > 0)
+		return res;
+	switch (SSL_get_error(cl->ssl, res)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0; /* close_notify */
+	case SSL_ERROR_SYSCALL:
+		if (!errno)
+			errno = ECONNRESET;
+		break;
+	default:
+		errno = EPROTO;
+		break;
+	}
+	ERR_clear_error();
+	return -1;
+}
+
+static ssize_t tls_read(struct client *cl, char *buf, size_t len)
+{
+	return tls_result(cl, SSL_read(cl->ssl, buf, len));
+}
+
+/* without kTLS every byte goes through SSL_write(), a record at a time.
+ * short pieces are gathered so a header and a small body make one record
+ * rather than two. a retry after EAGAIN rebuilds the same bytes from
+ * write_ofs, which is what OpenSSL wants to see again. */
+static ssize_t send_replies_tls(struct client *cl, size_t budget)
+{
+	static char gather[16384]; /* the largest record */
+	size_t ofs = cl->write_ofs;
+	ssize_t total = 0;
+	unsigned i = 0;
+
+	while (i < cl->nreplies && (size_t)total < budget) {
+		const char *p = NULL;
+		size_t len = 0, n;
+		ssize_t res;
+
+		/* gather from (i, ofs) until something long comes up */
+		while (i < cl->nreplies && len < sizeof(gather)) {
+			const struct reply *r = &cl->replies[i];
+			size_t hlen = reply_hdr_len(r);
+			const char *seg;
+			size_t seg_len;
+
+			if (ofs < hlen) {
+				seg = reply_hdr(r, ofs, &seg_len);
+			} else if (ofs < hlen + r->body_len) {
+				seg = r->body + (ofs - hlen);
+				seg_len = hlen + r->body_len - ofs;
+			} else {
+				i++;
+				ofs = 0;
+				continue;
+			}
+			if (!len && seg_len >= sizeof(gather)) {
+				p = seg; /* long enough to be sent as it is */
+				len = seg_len;
+				break;
+			}
+			n = seg_len < sizeof(gather) - len ?
+				seg_len : sizeof(gather) - len;
+			memcpy(gather + len, seg, n);
+			len += n;
+			ofs += n;
+			p = gather;
+		}
+		if (!len)
+			break;
+		if (len > budget - total)
+			len = budget - total;
+		if (len > INT_MAX)
+			len = INT_MAX;
+		/* partial writes return after each record, only EAGAIN says
+		 * the socket is full */
+		res = tls_result(cl, SSL_write(cl->ssl, p, len));
+		if (res < 0)
+			return total ? total : res;
+		total += res;
+		/* carry on from wherever the bytes written end */
+		i = 0;
+		ofs = cl->write_ofs + total;
+		while (i < cl->nreplies && ofs >=
+			reply_hdr_len(&cl->replies[i]) + cl->replies[i].body_len) {
+			ofs -= reply_hdr_len(&cl->replies[i]) +
+				cl->replies[i].body_len;
+			i++;
+		}
+	}
+	return total;
+}
+
+static int client_read(struct client *cl);
+
+static int tls_handshake(struct client *cl)
+{
+	int res = SSL_do_handshake(cl->ssl);
+	const unsigned char *proto;
+	unsigned proto_len;
+
+	if (res != 1) {
+		switch (SSL_get_error(cl->ssl, res)) {
+		case SSL_ERROR_WANT_READ:
+			return client_set(cl, CONN_READ, EV_READ);
+		case SSL_ERROR_WANT_WRITE:
+			return client_set(cl, CONN_READ, EV_WRITE);
+		}
+		log_debug("closing fd %d:TLS handshake failed\n", cl->fd);
+		ERR_clear_error();
+		return 0;
+	}
+	cl->flags &= ~CL_HANDSHAKE;
+	STAT_ADD(tls_handshakes, 1);
+	if (SSL_session_reused(cl->ssl))
+		STAT_ADD(tls_resumed, 1);
+#ifdef BIO_get_ktls_send
+	if (BIO_get_ktls_send(SSL_get_wbio(cl->ssl))) {
+		cl->flags |= CL_KTLS;
+		STAT_ADD(ktls, 1);
+	}
+#endif
+	SSL_get0_alpn_selected(cl->ssl, &proto, &proto_len);
+	if (proto_len == 2 && !memcmp(proto, "h2", 2))
+		return h2_start(cl, H2_PREFACE_LEN) && h2_ready(cl, EV_READ);
+	if (!client_set(cl, CONN_READ, EV_READ))
+		return 0;
+	/* the request often came in with the client's Finished */
+	return client_read(cl);
+}
+#endif
+
+/**** pacing ****/
+
+/* top up the token bucket for the time since it was last done */
+static size_t pace_refill(struct client *cl, uint64_t now)
+{
+	uint64_t add = (now - cl->paced_at) * pace_rate / 1000000;
+
+	/* leave a fraction of a byte to build up for next time */
+	if (add) {
+		cl->tokens = add >= pace_depth - cl->tokens ?
+			pace_depth : cl->tokens + add;
+		cl->paced_at = now;
+	}
+	return cl->tokens;
+}
+
+/* out of tokens, drop interest until the bucket has filled up again */
+static int pace_park(struct client *cl)
+{
+	if (!client_set(cl, CONN_PACED, 0))
+		return 0;
+	cl->next = NULL;
+	cl->prev = paced_tail;
+	*paced_tail = cl;
+	paced_tail = &cl->next;
+	cl->paced_until = cl->paced_at +
+		(uint64_t)(pace_depth - cl->tokens) * 1000000 / pace_rate;
+	STAT_ADD(paced, 1);
+	return 1;
+}
+
+/* milliseconds until the first parked writer may go on, -1 for none */
+static int pace_next_ms(void)
+{
+	if (!paced_head)
+		return -1;
+	if (paced_head->paced_until <= loop_usec)
+		return 0;
+	return (paced_head->paced_until - loop_usec + 999) / 1000;
+}
+
+/* the writers whose time has come go back to waiting for the socket */
+static void pace_resume(void)
+{
+	struct client *cl;
+
+	while ((cl = paced_head) && cl->paced_until <= loop_usec) {
+		paced_unlink(cl);
+		if (!client_set(cl, CONN_WRITE, EV_WRITE)) {
+			log_info("closing fd %d:%s\n", cl->fd, strerror(errno));
+			client_free(cl);
+		}
+	}
+}
+
+static int client_write(struct client *cl)
+{
+	size_t budget = SIZE_MAX;
+	ssize_t res;
+
+	assert(cl->fd != -1);
+	assert(cl->nreplies > 0);
+	if (pace_rate) {
+		budget = pace_refill(cl, loop_usec);
+		if (!budget)
+			return pace_park(cl);
+	}
+#ifdef HAVE_OPENSSL
+	if (cl->ssl && !(cl->flags & CL_KTLS))
+		res = send_replies_tls(cl, budget);
+	else
+#endif
+	if (zerocopy_fl)
+		res = send_replies_zc(cl, budget);
+	else
+		res = send_replies(cl, budget);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 1;
+		log_debug("closing fd %d:%s\n", cl->fd, strerror(errno));
+		STAT_ADD(disconnects, 1);
+		return 0;
+	}
+	STAT_ADD(bytes_written, res);
+	replies_sent(cl, res);
+	cl->last = loop_now;
+	if (pace_rate)
+		cl->tokens -= res;
+	if (cl->nreplies) {
+		STAT_ADD(partial_writes, 1);
+		if (pace_rate && !cl->tokens)
+			return pace_park(cl);
+		return 1;
+	}
+	if (cl->flags & CL_CLOSING) {
+		log_debug("closing fd %d:completed\n", cl->fd);
+		return 0;
+	}
+	/* keep-alive, go back to being a reader. the longer idle timeout
+	 * needs no re-arming, the wheel checks it when the slot comes up. */
+	if (!cl->in_len && cl->state == PARSE_REQUEST)
+		cl->flags |= CL_IDLE;
+	else
+		cl->begin = cl->last; /* the pipelined request's clock starts */
+	return client_resume(cl);
+}
+
+/* turn r into a 206 with a window of its body, or a 416. the header is
+ * the precomputed one with the status and Content-Length swapped out. */
+static void range_reply(struct client *cl, struct reply *r)
+{
+	char *buf = cl->range_hdr;
+	size_t size = sizeof(cl->range_hdr);
+	size_t first = cl->range_first, last = cl->range_last;
+	size_t total = r->body_len;
+	const char *head, *mid, *tail;
+	size_t len;
+	unsigned i;
+
+	/* the buffer is still queued, serving all of it is allowed too */
+	for (i = 0; i + 1 < cl->nreplies; i++)
+		if (cl->replies[i].hdr == buf)
+			return;
+	if (first == SIZE_MAX) {
+		/* the final last bytes, none of them can't be satisfied */
+		first = !last ? total : last < total ? total - last : 0;
+		last = total - 1;
+	} else if (last >= total) {
+		last = total - 1;
+	}
+	if (first >= total) {
+		len = snprintf(buf, size,
+			"HTTP/1.1 416 Range Not Satisfiable\r\n"
+			"Content-Range: bytes */%zu\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n", total);
+		r->hdr = buf;
+		r->hdr_len = len;
+		r->body_len = 0;
+		return;
+	}
+	/* our own headers, so the lines are all there */
+	head = strchr(r->hdr, '\n') + 1;
+	mid = strstr(head, "Content-Length:");
+	tail = strchr(mid, '\n') + 1;
+	len = snprintf(buf, size,
+		"HTTP/1.1 206 Partial Content\r\n"
+		"%.*s"
+		"Content-Range: bytes %zu-%zu/%zu\r\n"
+		"Content-Length: %zu\r\n"
+		"%s", (int)(mid - head), head, first, last, total,
+		last - first + 1, tail);
+	if (len >= size)
+		return; /* too long to fit, send it all */
+	r->hdr = buf;
+	r->hdr_len = len;
+	r->body += first;
+	r->body_len = last - first + 1;
+}
+
+/* queue the answer request_line() found, passing on its reference */
+static void do_get(struct client *cl)
+{
+	const struct entry *e = cl->entry;
+	const char *hdr304, *h2hdr304;
+	size_t hdr304_len, h2hdr304_len;
+	struct reply *r;
+	unsigned bit;
+	int i;
+
+	log_debug("%s():%d:HERE\n", __func__, __LINE__);
+	assert(cl->nreplies < HTTP_PIPELINE);
+	STAT_ADD(requests, 1);
+	assert(cl->content != NULL);
+	r = &cl->replies[cl->nreplies++];
+	r->content = cl->content;
+	r->entry = e;
+	r->hdr = e->hdr;
+	r->hdr_len = e->hdr_len;
+	r->h2hdr = e->h2hdr;
+	r->h2hdr_len = e->h2hdr_len;
+	r->body = e->msg;
+	r->body_len = e->msg_len;
+	r->from_file = 1;
+	hdr304 = e->hdr304;
+	hdr304_len = e->hdr304_len;
+	h2hdr304 = e->h2hdr304;
+	h2hdr304_len = e->h2hdr304_len;
+	bit = 1u << NR_VARIANTS;
+	/* variants are sorted, the first acceptable one is the smallest */
+	for (i = 0; i < NR_VARIANTS; i++) {
+		const struct variant *v = &e->variants[i];
+
+		if (v->body && (cl->accept & (1u << v->enc))) {
+			r->hdr = v->hdr;
+			r->hdr_len = v->hdr_len;
+			r->h2hdr = v->h2hdr;
+			r->h2hdr_len = v->h2hdr_len;
+			r->body = v->body;
+			r->body_len = v->body_len;
+			r->from_file = 0;
+			hdr304 = v->hdr304;
+			hdr304_len = v->hdr304_len;
+			h2hdr304 = v->h2hdr304;
+			h2hdr304_len = v->h2hdr304_len;
+			bit = 1u << v->enc;
+			break;
+		}
+	}
+	/* If-None-Match wins when both are sent */
+	if (e->etag[0] && ((cl->flags & CL_INM) ? (cl->match & bit) :
+		(cl->ims && e->st.st_mtime <= cl->ims))) {
+		r->hdr = hdr304;
+		r->hdr_len = hdr304_len;
+		r->h2hdr = h2hdr304;
+		r->h2hdr_len = h2hdr304_len;
+		r->body_len = 0;
+	} else if (e->etag[0] && (cl->flags & CL_RANGE) &&
+		!(cl->flags & CL_HEAD) &&
+		(!(cl->flags & CL_IFRANGE) || (cl->ifrange & bit))) {
+		range_reply(cl, r);
+	}
+	if (cl->flags & CL_HEAD)
+		r->body_len = 0;
+	/* a copy, the second may change while it is part way out */
+	memcpy(r->date, date_line, DATE_LINE_LEN);
+	if (cl->flags & CL_LOG)
+		log_request(cl, r->hdr + 9, r->body_len); /* "HTTP/1.1 200" */
+	if (cl->flags & CL_CLOSE)
+		cl->flags |= CL_CLOSING; /* nothing after this one is read */
+	cl->accept = 0;
+	cl->match = 0;
+	cl->ims = 0;
+	cl->ifrange = 0;
+	cl->flags &= ~CL_REQUEST;
+	cl->content = NULL;
+	cl->entry = NULL;
+}
+
+/* whether what is written to the socket reaches the client as it is */
+static int client_plain(const struct client *cl)
+{
+#ifdef HAVE_OPENSSL
+	return !cl->ssl || (cl->flags & CL_KTLS);
+#else
+	(void)cl;
+	return 1;
+#endif
+}
+
+/* the cheap way out for a request we won't serve: a canned error in one
+ * non-blocking send and a shutdown(), rather than a close() that resets
+ * the connection and has the client retry. what it sends after that is
+ * read and dropped for HTTP_LINGER seconds. behind queued replies, or
+ * through TLS, it is queued as a reply like any other. 0 to close now. */
+static int client_reject(struct client *cl, const struct entry *e)
+{
+	struct iovec iov[3];
+	ssize_t len;
+
+	STAT_ADD(rejected, 1);
+	if (!cl->content)
+		log_start(cl, "-", 1); /* no request line to speak of */
+	if (cl->nreplies || !client_plain(cl)) {
+		if (!cl->content)
+			cl->content = content_get(current);
+		cl->entry = e;
+		cl->flags |= CL_CLOSE;
+		do_get(cl);
+		return 1;
+	}
+	iov[0].iov_base = (char*)e->hdr;
+	iov[0].iov_len = e->hdr_len - 2;
+	iov[1].iov_base = date_line;
+	iov[1].iov_len = DATE_LINE_LEN;
+	iov[2].iov_base = e->msg;
+	iov[2].iov_len = (cl->flags & CL_HEAD) ? 0 : e->msg_len;
+	len = writev(cl->fd, iov, 3);
+	if (len > 0)
+		STAT_ADD(bytes_written, len);
+	if (cl->flags & CL_LOG)
+		log_request(cl, e->hdr + 9, iov[2].iov_len);
+	if (cl->content)
+		content_put(cl->content);
+	cl->content = NULL;
+	cl->entry = NULL;
+	cl->flags &= ~(CL_REQUEST | CL_IDLE);
+	if (len < 0 || shutdown(cl->fd, SHUT_WR))
+		return 0;
+	log_debug("fd %d rejected with %.3s\n", cl->fd, e->hdr + 9);
+	cl->flags |= CL_LINGER;
+	cl->in_ofs = cl->in_len = 0;
+	cl->begin = cl->last = loop_now;
+	timer_arm(cl);
+	conn_since[cl->fd] = cl->begin;
+	return client_set(cl, CONN_READ, EV_READ);
+}
+
+/* after client_reject(), drop what arrives. 0 once the client is gone. */
+static int client_linger(struct client *cl)
+{
+	ssize_t len;
+	int i;
+
+	/* a little each wakeup, however fast it comes */
+	for (i = 0; i < 4; i++) {
+		len = read(cl->fd, cl->in, sizeof(cl->in));
+		if (len > 0)
+			continue;
+		return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+			errno == EINTR);
+	}
+	return 1;
+}
+
+/* does a comma separated header value contain token? */
+static int has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+
+	while (*value) {
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		if (!strncasecmp(value, token, len) &&
+			(!value[len] || value[len] == ',' ||
+			value[len] == ' ' || value[len] == '\t'))
+			return 1;
+		while (*value && *value != ',')
+			value++;
+	}
+	return 0;
+}
+
+/* the q value of a token's parameters, 0 if it says "q=0" */
+static int qvalue_nonzero(const char *params, const char *end)
+{
+	while (params < end) {
+		while (params < end && (*params == ';' || *params == ' ' ||
+			*params == '\t'))
+			params++;
+		if (end - params > 2 && (*params == 'q' || *params == 'Q') &&
+			params[1] == '=') {
+			for (params += 2; params < end; params++)
+				if (*params != '0' && *params != '.')
+					return *params >= '1' && *params <= '9';
+			return 0;
+		}
+		while (params < end && *params != ';')
+			params++;
+	}
+	return 1;
+}
+
+/* turn an Accept-Encoding value into a bit per acceptable variant */
+static unsigned accept_encoding(const char *value)
+{
+	unsigned accept = 0, refuse = 0, all;
+	int wildcard = 0;
+	int i;
+
+	while (*value) {
+		const char *tok, *end;
+		size_t len;
+		int ok;
+
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		tok = value;
+		while (*value && *value != ',' && *value != ';' &&
+			*value != ' ' && *value != '\t')
+			value++;
+		len = value - tok;
+		end = value;
+		while (*end && *end != ',')
+			end++;
+		ok = qvalue_nonzero(value, end);
+		value = end;
+		if (len == 1 && *tok == '*') {
+			wildcard = ok;
+			continue;
+		}
+		for (i = 0; i < NR_VARIANTS; i++) {
+			if (strlen(encodings[i].name) != len ||
+				strncasecmp(tok, encodings[i].name, len))
+				continue;
+			if (ok)
+				accept |= 1u << i;
+			else
+				refuse |= 1u << i;
+		}
+	}
+	all = (1u << NR_VARIANTS) - 1;
+	if (wildcard)
+		accept |= all & ~refuse;
+	return accept;
+}
+
+/* a bit per representation of e named by an If-None-Match value, the
+ * same bits as accept with identity above them. weak comparison, so a
+ * W/ prefix is ignored. */
+static unsigned if_none_match(const struct entry *e, const char *value)
+{
+	unsigned match = 0;
+	int i;
+
+	if (!e->etag[0])
+		return 0; /* nothing there for it to match */
+	while (*value) {
+		const char *tok;
+		size_t len;
+
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		tok = value;
+		while (*value && *value != ',' && *value != ' ' &&
+			*value != '\t')
+			value++;
+		len = value - tok;
+		if (len == 1 && *tok == '*')
+			return ~0u;
+		if (len > 2 && !strncmp(tok, "W/", 2)) {
+			tok += 2;
+			len -= 2;
+		}
+		if (len == strlen(e->etag) && !memcmp(tok, e->etag, len))
+			match |= 1u << NR_VARIANTS;
+		for (i = 0; i < NR_VARIANTS; i++) {
+			const struct variant *v = &e->variants[i];
+
+			if (v->body && len == strlen(v->etag) &&
+				!memcmp(tok, v->etag, len))
+				match |= 1u << v->enc;
+		}
+	}
+	return match;
+}
+
+/* an IMF-fixdate, the only format we send and the only one parsed */
+static time_t http_date(const char *value)
+{
+	struct tm tm;
+
+	while (*value == ' ' || *value == '\t')
+		value++;
+	memset(&tm, 0, sizeof(tm));
+	if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
+	return timegm(&tm);
+}
+
+/* a single "bytes=first-last" range, either end may be left out. several
+ * ranges or anything else we don't understand are ignored, and the whole
+ * body is sent. */
+static int parse_range(struct client *cl, const char *value)
+{
+	unsigned long long first, last = ULLONG_MAX;
+	char *end;
+
+	while (*value == ' ' || *value == '\t')
+		value++;
+	if (strncasecmp(value, "bytes=", 6) || strchr(value, ','))
+		return 0;
+	value += 6;
+	if (*value == '-') {
+		if (value[1] < '0' || value[1] > '9')
+			return 0;
+		last = strtoull(value + 1, &end, 10);
+		first = ULLONG_MAX;
+	} else {
+		if (*value < '0' || *value > '9')
+			return 0;
+		first = strtoull(value, &end, 10);
+		if (*end++ != '-')
+			return 0;
+		if (*end >= '0' && *end <= '9') {
+			last = strtoull(end, &end, 10);
+			if (last < first)
+				return 0;
+		}
+	}
+	while (*end == ' ' || *end == '\t')
+		end++;
+	if (*end)
+		return 0;
+	cl->range_first = first > SIZE_MAX ? SIZE_MAX : first;
+	cl->range_last = last > SIZE_MAX ? SIZE_MAX : last;
+	return 1;
+}
+
+/* the representations of e an If-Range value still matches, either by
+ * strong ETag or by the exact Last-Modified date */
+static unsigned if_range(const struct entry *e, const char *value)
+{
+	int i;
+
+	while (*value == ' ' || *value == '\t')
+		value++;
+	if (*value != '"')
+		return http_date(value) == e->st.st_mtime ? ~0u : 0;
+	if (!strcmp(value, e->etag))
+		return 1u << NR_VARIANTS;
+	for (i = 0; i < NR_VARIANTS; i++)
+		if (e->variants[i].body && !strcmp(value, e->variants[i].etag))
+			return 1u << e->variants[i].enc;
+	return 0;
+}
+
+static struct content *stats_content(void);
+
+/* undo the %XX escapes of a target in place, returning its new end. NULL
+ * for a bad escape, or for %00 and %2F, which would name something other
+ * than what the target's slashes say. */
+static char *percent_decode(char *p, char *end)
+{
+	char *out = p;
+	int hi, lo;
+
+	for (; p < end; p++) {
+		if (*p != '%') {
+			*out++ = *p;
+			continue;
+		}
+		if (end - p < 3 || !isxdigit((unsigned char)p[1]) ||
+			!isxdigit((unsigned char)p[2]))
+			return NULL;
+		hi = isdigit((unsigned char)p[1]) ? p[1] - '0' : (p[1] | 0x20) - 'a' + 10;
+		lo = isdigit((unsigned char)p[2]) ? p[2] - '0' : (p[2] | 0x20) - 'a' + 10;
+		if (!(hi << 4 | lo) || (hi << 4 | lo) == '/')
+			return NULL;
+		*out++ = hi << 4 | lo;
+		p += 2;
+	}
+	return out;
+}
+
+/* request line, "<method> <target> HTTP/1.x", NULL if it was too long to
+ * keep, which is answered with a 414. the target is looked up right away,
+ * in the snapshot the client holds on to until the request is complete.
+ * returns 0 if malformed. */
+static int request_line(struct client *cl, char *line, size_t len)
+{
+	const struct entry *e;
+	char *target, *end, *query;
+
+	assert(cl->content == NULL);
+	cl->content = content_get(current);
+	cl->entry = &not_found;
+	log_start(cl, line ? line : "-", line ? len : 1);
+	/* HTTP/1.0 and anything we can't make sense of isn't persistent */
+	if (!line || len < 8 || strcmp(line + len - 8, "HTTP/1.1"))
+		cl->flags |= CL_CLOSE;
+	if (!line) {
+		cl->entry = &uri_too_long;
+		return 1;
+	}
+	target = memchr(line, ' ', len);
+	if (!target)
+		return 0;
+	if (target - line == 4 && !memcmp(line, "HEAD", 4)) {
+		cl->flags |= CL_HEAD;
+	} else if (target - line != 3 || memcmp(line, "GET", 3)) {
+		/* there may be a body we don't know how to skip */
+		cl->entry = &not_allowed;
+		cl->flags |= CL_CLOSE;
+		return 1;
+	}
+	target++;
+	end = memchr(target, ' ', line + len - target);
+	if (!end)
+		end = line + len;
+	/* the query doesn't select anything, a static file is all there is */
+	query = memchr(target, '?', end - target);
+	if (query)
+		end = query;
+	end = percent_decode(target, end);
+	if (!end)
+		return 0;
+	if (stats_path && (size_t)(end - target) == strlen(stats_path) &&
+		!memcmp(target, stats_path, end - target)) {
+		struct content *c = stats_content();
+
+		if (c) {
+			content_put(cl->content);
+			cl->content = c;
+			cl->entry = &c->entries[0];
+		}
+		return 1;
+	}
+	e = content_lookup(cl->content, target, end - target);
+	if (e)
+		cl->entry = e;
+	return 1;
+}
+
+static void header_line(struct client *cl, const char *line, size_t len)
+{
+	if (!strncasecmp(line, "Connection:", 11) &&
+		has_token(line + 11, "close"))
+		cl->flags |= CL_CLOSE;
+	else if (!strncasecmp(line, "Accept-Encoding:", 16))
+		cl->accept = accept_encoding(line + 16);
+	else if (!strncasecmp(line, "If-None-Match:", 14)) {
+		cl->match |= if_none_match(cl->entry, line + 14);
+		cl->flags |= CL_INM;
+	} else if (!strncasecmp(line, "If-Modified-Since:", 18)) {
+		cl->ims = http_date(line + 18);
+	} else if (!strncasecmp(line, "Range:", 6)) {
+		if (parse_range(cl, line + 6))
+			cl->flags |= CL_RANGE;
+	} else if (!strncasecmp(line, "If-Range:", 9)) {
+		cl->ifrange = if_range(cl->entry, line + 9);
+		cl->flags |= CL_IFRANGE;
+	} else if ((cl->flags & CL_LOG) && !strncasecmp(line, "Referer:", 8)) {
+		log_copy(cl->log_referer, sizeof(cl->log_referer), line + 8,
+			len - 8);
+	} else if ((cl->flags & CL_LOG) &&
+		!strncasecmp(line, "User-Agent:", 11)) {
+		log_copy(cl->log_agent, sizeof(cl->log_agent), line + 11,
+			len - 11);
+	}
+}
+
+/* run the request parser over the buffered input, queueing a reply for
+ * each complete request. one that is malformed or too big is rejected.
+ * returns 0 to close the connection.
+ *
+ * lines are found with memchr(), which libc vectorizes, and handled in
+ * place. a partial line stays in in[] and scanning resumes where it left
+ * off once more arrives. */
+static int client_parse(struct client *cl)
+{
+	const struct entry *reject = NULL;
+
+	/* stop at a full pipeline, or once a reply will close the connection */
+	while (cl->in_ofs < cl->in_len && cl->nreplies < HTTP_PIPELINE &&
+		!(cl->flags & CL_CLOSING)) {
+		char *line = cl->in + cl->in_ofs;
+		size_t avail = cl->in_len - cl->in_ofs;
+		size_t len;
+		char *nl;
+
+		/* a CRLF left over from the last request goes, RFC 9112 2.2 */
+		if (cl->state == PARSE_REQUEST && *line == '\r' &&
+			avail == 1)
+			break;
+		if (cl->state == PARSE_REQUEST && (*line == '\n' ||
+			(*line == '\r' && line[1] == '\n'))) {
+			cl->in_ofs += *line == '\r' ? 2 : 1;
+			continue;
+		}
+		/* methods are upper case, don't wait for more of anything else */
+		if (cl->state == PARSE_REQUEST &&
+			(*line < 'A' || *line > 'Z')) {
+			reject = &bad_request;
+			break;
+		}
+		/* HTTP/2 with prior knowledge, once the replies before it are
+		 * out */
+		if (cl->state == PARSE_REQUEST &&
+			!memcmp(line, h2_preface, avail < H2_PREFACE_LEN ?
+			avail : H2_PREFACE_LEN)) {
+			if (avail < H2_PREFACE_LEN || cl->nreplies)
+				break;
+			cl->in_ofs += H2_PREFACE_LEN;
+			return h2_start(cl, 0);
+		}
+		nl = memchr(line + cl->scan_ofs, '\n', avail - cl->scan_ofs);
+		if (!nl) {
+			if (cl->state == PARSE_REQUEST &&
+				avail == sizeof(cl->in)) {
+				reject = &uri_too_long;
+			} else if ((cl->flags & CL_LONGLINE) ||
+				avail == sizeof(cl->in)) {
+				/* a header too long to keep, skip the rest */
+				cl->flags |= CL_LONGLINE;
+				cl->fields_len += avail;
+				cl->in_ofs = cl->in_len;
+				cl->scan_ofs = 0;
+				if (cl->fields_len > HTTP_FIELDS_MAX)
+					reject = &fields_too_large;
+			} else {
+				cl->scan_ofs = avail;
+			}
+			break;
+		}
+		cl->in_ofs = nl + 1 - cl->in;
+		cl->scan_ofs = 0;
+		if (cl->state != PARSE_REQUEST) {
+			cl->fields_len += nl + 1 - line;
+			if (cl->fields_len > HTTP_FIELDS_MAX) {
+				reject = &fields_too_large;
+				break;
+			}
+		}
+		len = nl - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		line[len] = 0;
+		if (cl->flags & CL_LONGLINE) {
+			cl->flags &= ~CL_LONGLINE;
+			line = NULL; /* the start of it is gone */
+		}
+		log_debug("read fd %d:state=%d line '%s'\n", cl->fd, cl->state,
+			line ? line : "(too long)");
+		if (cl->state == PARSE_REQUEST) {
+			if (!request_line(cl, line, len)) {
+				reject = &bad_request;
+				break;
+			}
+			cl->state = PARSE_HEADERS;
+			cl->fields_len = 0;
+		} else if (line && !len) {
+			/* blank line, end of the request */
+			do_get(cl);
+			cl->state = PARSE_REQUEST;
+			cl->begin = cl->last;
+		} else if (line) {
+			header_line(cl, line, len);
+		}
+	}
+	if (reject && !client_reject(cl, reject))
+		return 0;
+	if (cl->flags & CL_CLOSING)
+		cl->in_ofs = cl->in_len; /* ignore anything after the last */
+	if (cl->in_ofs == cl->in_len) {
+		cl->in_ofs = 0;
+		cl->in_len = 0;
+	}
+	return 1;
+}
+
+/* parse what is already buffered, then become a writer if there are
+ * replies to send or a reader if more of the request is needed. */
+static int client_resume(struct client *cl)
+{
+	if (!client_parse(cl))
+		return 0;
+	if (cl->flags & CL_LINGER)
+		return 1;
+	if (cl->h2)
+		return h2_ready(cl, 0);
+	if (cl->nreplies)
+		return client_set(cl, CONN_WRITE, EV_WRITE);
+	if (cl->flags & CL_IDLE) {
+		conn_since[cl->fd] = cl->last;
+		return client_set(cl, CONN_IDLE, EV_READ);
+	}
+	conn_since[cl->fd] = cl->begin;
+	return client_set(cl, CONN_READ, EV_READ);
+}
+
+static int client_read(struct client *cl)
+{
+	ssize_t len;
+
+	/* a pipeline that doesn't fit waits in the kernel's buffer */
+	if (cl->in_ofs) {
+		memmove(cl->in, cl->in + cl->in_ofs, cl->in_len - cl->in_ofs);
+		cl->in_len -= cl->in_ofs;
+		cl->in_ofs = 0;
+	}
+	assert(cl->in_len < sizeof(cl->in));
+#ifdef HAVE_OPENSSL
+	if (cl->ssl)
+		len = tls_read(cl, cl->in + cl->in_len,
+			sizeof(cl->in) - cl->in_len);
+	else
+#endif
+	len = read(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len);
+	if (len <= 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR))
+			return 1;
+		log_debug("closing fd %d:%s\n", cl->fd,
+			len ? strerror(errno) : "end of file");
+		STAT_ADD(disconnects, 1);
+		return 0;
+	}
+	log_debug("%s():fd %d read %d bytes\n", __func__, cl->fd, len);
+	cl->last = loop_now;
+	if (cl->flags & CL_IDLE) {
+		/* the read timeout is shorter, move it up in the wheel */
+		cl->flags &= ~CL_IDLE;
+		cl->begin = cl->last;
+		timer_arm(cl);
+	}
+	cl->in_len += len;
+	return client_resume(cl);
+}
+
+/**** HTTP/2 ****/
+
+/* one connection carries every stream, so the content table is served
+ * with a single socket and client slot per browser rather than six. each
+ * peer frame is handled as it arrives, a request goes through the same
+ * request_line(), header_line() and do_get() as HTTP/1.1, and its reply
+ * becomes a stream. what goes out is batched: control frames and reply
+ * headers copied in ctl[], then a DATA frame per stream whose payload is
+ * the body itself, all in one writev(). */
+#define H2_STREAMS 100 /* SETTINGS_MAX_CONCURRENT_STREAMS, the suggested least */
+#define H2_FRAME 16384 /* largest frame payload, the protocol's minimum */
+#define H2_WINDOW 65535 /* initial flow control window */
+#define H2_BATCH 64 /* DATA frames in one writev() */
+#define H2_CTL 4096
+#define H2_BLOCK 8192 /* a header block spread over CONTINUATION frames */
+/* room for what one frame can make us send, plus a GOAWAY */
+#define H2_RESERVE (9 + HTTP_HDRMAX + 17)
+
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_PRIORITY 2
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PUSH_PROMISE 5
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION 9
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIO 0x20
+
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+struct h2_stream {
+	uint32_t id; /* 0 for a free slot */
+	int64_t window; /* what the peer lets us send on it */
+	size_t sent; /* bytes of the body framed so far */
+	struct reply r;
+};
+
+struct h2 {
+	int64_t window; /* of the connection */
+	int64_t initial; /* the peer's SETTINGS_INITIAL_WINDOW_SIZE */
+	size_t max_frame; /* the peer's SETTINGS_MAX_FRAME_SIZE */
+	uint32_t last_id; /* newest stream the peer opened */
+	int goaway; /* 1 once the peer sent GOAWAY, 2 once we did */
+	unsigned preface; /* bytes of the client preface not yet seen */
+	unsigned nstreams, next; /* next is where DATA starts, round robin */
+	struct h2_stream streams[H2_STREAMS];
+	/* the request being decoded, 0 to ignore it, 1 while pseudo-headers
+	 * may come and 2 once request_line() has seen them */
+	int req;
+	char method[16];
+	size_t method_len;
+	char path[HTTP_BUFSIZE];
+	size_t path_len;
+	/* the batch being written, ctl_batch bytes of ctl[] then DATA */
+	struct iovec iov[1 + 2 * H2_BATCH];
+	unsigned iov_ofs, iov_len;
+	size_t ctl_batch;
+	unsigned char fh[H2_BATCH][9];
+	size_t ctl_len;
+	char ctl[H2_CTL];
+	uint32_t blk_id; /* stream of a header block waiting for the rest */
+	size_t blk_len;
+	unsigned char blk[H2_BLOCK];
+	struct hpack dec;
+	size_t in_len;
+	unsigned char in[9 + H2_FRAME];
+};
+
+static uint32_t h2_get(const unsigned char *p, int n)
+{
+	uint32_t v = 0;
+
+	while (n--)
+		v = v << 8 | *p++;
+	return v;
+}
+
+static void h2_put(unsigned char *p, uint32_t v, int n)
+{
+	while (n--) {
+		p[n] = v;
+		v >>= 8;
+	}
+}
+
+static void h2_frame_hdr(unsigned char *p, size_t len, int type, int flags,
+	uint32_t id)
+{
+	h2_put(p, len, 3);
+	p[3] = type;
+	p[4] = flags;
+	h2_put(p + 5, id, 4);
+}
+
+/* queue a frame in ctl[], returns where its payload goes */
+static unsigned char *h2_queue(struct h2 *h, int type, int flags,
+	uint32_t id, size_t len)
+{
+	unsigned char *p = (unsigned char*)h->ctl + h->ctl_len;
+
+	assert(h->ctl_len + 9 + len <= sizeof(h->ctl));
+	h2_frame_hdr(p, len, type, flags, id);
+	h->ctl_len += 9 + len;
+	return p + 9;
+}
+
+static void h2_stream_free(struct h2_stream *s)
+{
+	content_put(s->r.content);
+	s->id = 0;
+}
+
+/* drop a stream, or cut it short if the batch being written may still
+ * point into its body. h2_batch_sent() retires it after that. */
+static void h2_stream_end(struct h2 *h, struct h2_stream *s)
+{
+	if (s->sent && h->iov_ofs < h->iov_len) {
+		s->r.body_len = s->sent;
+		return;
+	}
+	h2_stream_free(s);
+	h->nstreams--;
+}
+
+/* a connection error, nothing more is read and the connection closes
+ * once the GOAWAY is out */
+static void h2_error(struct client *cl, uint32_t code)
+{
+	struct h2 *h = cl->h2;
+	unsigned char *p;
+	unsigned i;
+
+	log_debug("fd %d:HTTP/2 error %u\n", cl->fd, code);
+	for (i = 0; i < H2_STREAMS; i++)
+		if (h->streams[i].id)
+			h2_stream_end(h, &h->streams[i]);
+	p = h2_queue(h, H2_GOAWAY, 0, 0, 8);
+	h2_put(p, h->last_id, 4);
+	h2_put(p + 4, code, 4);
+	h->goaway = 2;
+	h->in_len = 0;
+}
+
+/* pseudo-headers are collected for request_line(), the rest are passed
+ * to header_line() as HTTP/1.1 lines */
+static void h2_request_line(struct client *cl)
+{
+	struct h2 *h = cl->h2;
+	char line[sizeof(h->method) + sizeof(h->path) + 16];
+	int len;
+
+	len = snprintf(line, sizeof(line), "%.*s %.*s HTTP/2.0",
+		(int)h->method_len, h->method, (int)h->path_len, h->path);
+	/* a path too long to keep can't name anything, the same as a
+	 * request line that didn't fit in HTTP/1.1 */
+	if (!request_line(cl, h->path_len && h->path_len <= sizeof(h->path) ?
+		line : NULL, len) || !h->path_len)
+		cl->entry = &bad_request;
+	h->req = 2;
+}
+
+static void h2_header(void *arg, const char *name, size_t nlen,
+	const char *value, size_t vlen)
+{
+	static char line[HTTP_BUFSIZE];
+	struct client *cl = arg;
+	struct h2 *h = cl->h2;
+
+	if (!h->req)
+		return;
+	if (nlen && name[0] == ':') {
+		if (h->req != 1)
+			return;
+		if (nlen == 7 && !memcmp(name, ":method", 7)) {
+			h->method_len = vlen < sizeof(h->method) ?
+				vlen : sizeof(h->method);
+			memcpy(h->method, value, h->method_len);
+		} else if (nlen == 5 && !memcmp(name, ":path", 5)) {
+			h->path_len = vlen;
+			memcpy(h->path, value, vlen < sizeof(h->path) ?
+				vlen : sizeof(h->path));
+		}
+		return;
+	}
+	if (h->req == 1)
+		h2_request_line(cl);
+	/* a 206 is built from the HTTP/1.1 header, ranges get all of it */
+	if ((nlen == 5 && !memcmp(name, "range", 5)) ||
+		(nlen == 8 && !memcmp(name, "if-range", 8)) ||
+		nlen + vlen + 2 >= sizeof(line))
+		return;
+	memcpy(line, name, nlen);
+	line[nlen] = ':';
+	line[nlen + 1] = ' ';
+	memcpy(line + nlen + 2, value, vlen);
+	line[nlen + 2 + vlen] = 0;
+	header_line(cl, line, nlen + 2 + vlen);
+}
+
+/* a complete header block, a new request unless it is trailers */
+static void h2_headers(struct client *cl, uint32_t id,
+	const unsigned char *blk, size_t len)
+{
+	struct h2 *h = cl->h2;
+	struct h2_stream *s = NULL;
+	unsigned char *p;
+	struct reply *r;
+	unsigned i;
+
+	h->req = 0;
+	if (id > h->last_id) {
+		h->last_id = id;
+		if (!h->goaway)
+			for (i = 0; i < H2_STREAMS && !s; i++)
+				if (!h->streams[i].id)
+					s = &h->streams[i];
+		if (s) {
+			h->req = 1;
+			h->method_len = 0;
+			h->path_len = 0;
+		}
+	}
+	/* decoded even when ignored, to keep the table in step */
+	if (hpack_decode(&h->dec, blk, len, h2_header, cl)) {
+		h2_error(cl, H2_COMPRESSION_ERROR);
+		return;
+	}
+	if (!h->req) {
+		if (id == h->last_id) {
+			p = h2_queue(h, H2_RST_STREAM, 0, id, 4);
+			h2_put(p, H2_REFUSED_STREAM, 4);
+		}
+		return;
+	}
+	if (h->req == 1)
+		h2_request_line(cl);
+	h->req = 0;
+	do_get(cl);
+	cl->nreplies = 0;
+	/* only ever means the connection */
+	cl->flags &= ~(CL_CLOSE | CL_CLOSING);
+	r = &cl->replies[0];
+	p = h2_queue(h, H2_HEADERS, H2_END_HEADERS |
+		(r->body_len ? 0 : H2_END_STREAM), id,
+		r->h2hdr_len + DATE_H2_LEN);
+	memcpy(p, r->h2hdr, r->h2hdr_len);
+	memcpy(p + r->h2hdr_len, date_h2, DATE_H2_LEN);
+	if (!r->body_len) {
+		content_put(r->content);
+		return;
+	}
+	s->id = id;
+	s->window = h->initial;
+	s->sent = 0;
+	s->r = *r;
+	h->nstreams++;
+}
+
+static struct h2_stream *h2_stream(struct h2 *h, uint32_t id)
+{
+	unsigned i;
+
+	for (i = 0; i < H2_STREAMS; i++)
+		if (h->streams[i].id == id)
+			return &h->streams[i];
+	return NULL;
+}
+
+static void h2_settings(struct client *cl, const unsigned char *p,
+	size_t len)
+{
+	struct h2 *h = cl->h2;
+	unsigned i;
+
+	for (; len >= 6; p += 6, len -= 6) {
+		uint32_t v = h2_get(p + 2, 4);
+
+		switch (h2_get(p, 2)) {
+		case 4: /* SETTINGS_INITIAL_WINDOW_SIZE */
+			if (v > 0x7fffffff) {
+				h2_error(cl, H2_FLOW_CONTROL_ERROR);
+				return;
+			}
+			/* applies to the streams already open too */
+			for (i = 0; i < H2_STREAMS; i++)
+				h->streams[i].window += (int64_t)v - h->initial;
+			h->initial = v;
+			break;
+		case 5: /* SETTINGS_MAX_FRAME_SIZE */
+			if (v < H2_FRAME || v > 0xffffff) {
+				h2_error(cl, H2_PROTOCOL_ERROR);
+				return;
+			}
+			h->max_frame = v;
+			break;
+		}
+	}
+	h2_queue(h, H2_SETTINGS, H2_ACK, 0, 0);
+}
+
+/* handle one frame from the peer */
+static void h2_frame(struct client *cl, int type, int flags, uint32_t id,
+	const unsigned char *p, size_t len)
+{
+	struct h2 *h = cl->h2;
+	struct h2_stream *s;
+	size_t pad = 0;
+
+	if (h->blk_id && type != H2_CONTINUATION) {
+		h2_error(cl, H2_PROTOCOL_ERROR);
+		return;
+	}
+	switch (type) {
+	case H2_DATA:
+		/* a request body, which nothing here wants. the stream window
+		 * is left to close, only the connection's is kept open */
+		if (!id) {
+			h2_error(cl, H2_PROTOCOL_ERROR);
+		} else if (len) {
+			unsigned char *q = h2_queue(h, H2_WINDOW_UPDATE, 0, 0, 4);
+
+			h2_put(q, len, 4);
+		}
+		break;
+	case H2_HEADERS:
+		if (!(id & 1)) {
+			h2_error(cl, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (flags & H2_PADDED) {
+			if (!len) {
+				h2_error(cl, H2_PROTOCOL_ERROR);
+				break;
+			}
+			pad = *p++;
+			len--;
+		}
+		if (flags & H2_PRIO) {
+			if (len < 5) {
+				h2_error(cl, H2_PROTOCOL_ERROR);
+				break;
+			}
+			p += 5;
+			len -= 5;
+		}
+		if (pad > len) {
+			h2_error(cl, H2_PROTOCOL_ERROR);
+			break;
+		}
+		len -= pad;
+		if (flags & H2_END_HEADERS) {
+			h2_headers(cl, id, p, len);
+			break;
+		}
+		h->blk_id = id;
+		h->blk_len = 0;
+		/* fall through */
+	case H2_CONTINUATION:
+		if (!h->blk_id || id != h->blk_id) {
+			h2_error(cl, H2_PROTOCOL_ERROR);
+			break;
+		}
+		if (len > sizeof(h->blk) - h->blk_len) {
+			h2_error(cl, H2_COMPRESSION_ERROR);
+			break;
+		}
+		memcpy(h->blk + h->blk_len, p, len);
+		h->blk_len += len;
+		if ((type == H2_CONTINUATION ? flags : 0) & H2_END_HEADERS) {
+			h->blk_id = 0;
+			h2_headers(cl, id, h->blk, h->blk_len);
+		}
+		break;
+	case H2_RST_STREAM:
+		if (id && (s = h2_stream(h, id)))
+			h2_stream_end(h, s);
+		break;
+	case H2_SETTINGS:
+		if (id)
+			h2_error(cl, H2_PROTOCOL_ERROR);
+		else if ((flags & H2_ACK) ? len != 0 : len % 6 != 0)
+			h2_error(cl, H2_FRAME_SIZE_ERROR);
+		else if (!(flags & H2_ACK))
+			h2_settings(cl, p, len);
+		break;
+	case H2_PUSH_PROMISE:
+		h2_error(cl, H2_PROTOCOL_ERROR);
+		break;
+	case H2_PING:
+		if (id || len != 8)
+			h2_error(cl, H2_FRAME_SIZE_ERROR);
+		else if (!(flags & H2_ACK))
+			memcpy(h2_queue(h, H2_PING, H2_ACK, 0, 8), p, 8);
+		break;
+	case H2_GOAWAY:
+		if (!h->goaway)
+			h->goaway = 1; /* finish what was asked for, then close */
+		break;
+	case H2_WINDOW_UPDATE:
+		if (len != 4) {
+			h2_error(cl, H2_FRAME_SIZE_ERROR);
+			break;
+		}
+		len = h2_get(p, 4) & 0x7fffffff;
+		if (!len) {
+			h2_error(cl, H2_PROTOCOL_ERROR);
+		} else if (!id) {
+			h->window += len;
+			if (h->window > 0x7fffffff)
+				h2_error(cl, H2_FLOW_CONTROL_ERROR);
+		} else if ((s = h2_stream(h, id))) {
+			s->window += len;
+		}
+		break;
+	}
+	/* PRIORITY and anything unknown are ignored */
+}
+
+/* handle every complete frame in in[], for as long as there's room in
+ * ctl[] for the answer. returns 0 if the connection is to be closed. */
+static int h2_parse(struct client *cl)
+{
+	struct h2 *h = cl->h2;
+	size_t ofs = 0;
+
+	while (h->goaway < 2 && sizeof(h->ctl) - h->ctl_len >= H2_RESERVE) {
+		const unsigned char *p = h->in + ofs;
+		size_t avail = h->in_len - ofs, len;
+
+		if (h->preface) {
+			/* after ALPN, the same preface as for cleartext */
+			len = avail < h->preface ? avail : h->preface;
+			if (memcmp(p, h2_preface + H2_PREFACE_LEN - h->preface,
+				len))
+				return 0;
+			h->preface -= len;
+			ofs += len;
+			if (h->preface)
+				break;
+			continue;
+		}
+		if (avail < 9)
+			break;
+		len = h2_get(p, 3);
+		if (len > H2_FRAME) {
+			h2_error(cl, H2_FRAME_SIZE_ERROR);
+			return 1;
+		}
+		if (avail < 9 + len)
+			break;
+		h2_frame(cl, p[3], p[4], h2_get(p + 5, 4) & 0x7fffffff, p + 9,
+			len);
+		if (h->goaway == 2)
+			return 1;
+		ofs += 9 + len;
+		cl->begin = cl->last; /* a whole frame, not a trickle */
+	}
+	memmove(h->in, h->in + ofs, h->in_len - ofs);
+	h->in_len -= ofs;
+	return 1;
+}
+
+/* switch cl over, with the preface either already read or still to come.
+ * whatever followed it in in[] is the first of the frames. */
+static int h2_start(struct client *cl, unsigned preface)
+{
+	struct h2 *h;
+	unsigned char *p;
+
+	h = calloc(1, sizeof(*h));
+	if (!h) {
+		log_info("closing fd %d:%s\n", cl->fd, strerror(errno));
+		return 0;
+	}
+	cl->h2 = h;
+	h->window = H2_WINDOW;
+	h->initial = H2_WINDOW;
+	h->max_frame = H2_FRAME;
+	h->preface = preface;
+	h->dec.max = H2_TABLE;
+	p = h2_queue(h, H2_SETTINGS, 0, 0, 6);
+	h2_put(p, 3, 2); /* SETTINGS_MAX_CONCURRENT_STREAMS */
+	h2_put(p + 2, H2_STREAMS, 4);
+	h->in_len = cl->in_len - cl->in_ofs;
+	memcpy(h->in, cl->in + cl->in_ofs, h->in_len);
+	cl->in_ofs = 0;
+	cl->in_len = 0;
+	STAT_ADD(h2, 1);
+	log_debug("fd %d:HTTP/2\n", cl->fd);
+	return h2_parse(cl);
+}
+
+static void h2_free(struct client *cl)
+{
+	unsigned i;
+
+	for (i = 0; i < H2_STREAMS; i++)
+		if (cl->h2->streams[i].id)
+			h2_stream_free(&cl->h2->streams[i]);
+	free(cl->h2);
+	cl->h2 = NULL;
+}
+
+/* is there anything that could be written now? */
+static int h2_pending(const struct h2 *h)
+{
+	unsigned i;
+
+	if (h->iov_ofs < h->iov_len || h->ctl_len)
+		return 1;
+	if (h->window <= 0)
+		return 0;
+	for (i = 0; i < H2_STREAMS; i++) {
+		const struct h2_stream *s = &h->streams[i];
+
+		if (s->id && s->sent < s->r.body_len && s->window > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* the next batch: the control frames, then a DATA frame for each stream
+ * the windows allow, with no more than budget bytes of them. 0 if there
+ * was nothing to put in it. */
+static int h2_batch(struct h2 *h, size_t budget)
+{
+	unsigned i, n = 0, nfh = 0, skipped = 0;
+
+	if (h->ctl_len) {
+		h->iov[n].iov_base = h->ctl;
+		h->iov[n++].iov_len = h->ctl_len;
+		h->ctl_batch = h->ctl_len;
+	}
+	/* a frame from each stream in turn, until a whole round finds none */
+	for (i = h->next; skipped < H2_STREAMS && nfh < H2_BATCH &&
+		h->window > 0 && budget; i = (i + 1) % H2_STREAMS) {
+		struct h2_stream *s = &h->streams[i];
+		size_t len;
+
+		if (!s->id || s->sent == s->r.body_len || s->window <= 0) {
+			skipped++;
+			continue;
+		}
+		skipped = 0;
+		len = s->r.body_len - s->sent;
+		if (len > h->max_frame)
+			len = h->max_frame;
+		if ((int64_t)len > s->window)
+			len = s->window;
+		if ((int64_t)len > h->window)
+			len = h->window;
+		if (len > budget)
+			len = budget;
+		h2_frame_hdr(h->fh[nfh], len, H2_DATA,
+			s->sent + len == s->r.body_len ? H2_END_STREAM : 0, s->id);
+		h->iov[n].iov_base = h->fh[nfh++];
+		h->iov[n++].iov_len = 9;
+		h->iov[n].iov_base = (char*)s->r.body + s->sent;
+		h->iov[n++].iov_len = len;
+		s->sent += len;
+		s->window -= len;
+		h->window -= len;
+		budget -= len;
+	}
+	h->next = i; /* the next batch starts with the next stream along */
+	h->iov_ofs = 0;
+	h->iov_len = n;
+	return n != 0;
+}
+
+/* the batch is out, the streams that ended in it are done */
+static void h2_batch_sent(struct h2 *h)
+{
+	unsigned i;
+
+	h->ctl_len -= h->ctl_batch;
+	memmove(h->ctl, h->ctl + h->ctl_batch, h->ctl_len);
+	h->ctl_batch = 0;
+	h->iov_ofs = 0;
+	h->iov_len = 0;
+	for (i = 0; i < H2_STREAMS; i++) {
+		struct h2_stream *s = &h->streams[i];
+
+		if (s->id && s->sent == s->r.body_len) {
+			h2_stream_free(s);
+			h->nstreams--;
+		}
+	}
+}
+
+static ssize_t h2_writev(struct client *cl, const struct iovec *iov, int n)
+{
+#ifdef HAVE_OPENSSL
+	if (cl->ssl && !(cl->flags & CL_KTLS)) {
+		/* a record at a time, gathered the same from the same iov */
+		static char gather[16384];
+		size_t len = 0, k;
+
+		for (; n && len < sizeof(gather); iov++, n--) {
+			k = iov->iov_len < sizeof(gather) - len ?
+				iov->iov_len : sizeof(gather) - len;
+			memcpy(gather + len, iov->iov_base, k);
+			len += k;
+		}
+		return tls_result(cl, SSL_write(cl->ssl, gather, len));
+	}
+#endif
+	return writev(cl->fd, iov, n);
+}
+
+static int h2_write(struct client *cl)
+{
+	struct h2 *h = cl->h2;
+	size_t budget = SIZE_MAX, total = 0;
+	ssize_t res;
+
+	if (pace_rate) {
+		budget = pace_refill(cl, loop_usec);
+		if (!budget)
+			return pace_park(cl);
+	}
+	while (total < budget) {
+		size_t left;
+
+		if (h->iov_ofs == h->iov_len && !h2_batch(h, budget - total))
+			break;
+		res = h2_writev(cl, h->iov + h->iov_ofs,
+			h->iov_len - h->iov_ofs);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR)
+				break;
+			log_debug("closing fd %d:%s\n", cl->fd, strerror(errno));
+			STAT_ADD(disconnects, 1);
+			return 0;
+		}
+		if (!res)
+			break;
+		total += res;
+		for (left = res; left; h->iov_ofs++) {
+			struct iovec *v = &h->iov[h->iov_ofs];
+
+			if (left < v->iov_len) {
+				v->iov_base = (char*)v->iov_base + left;
+				v->iov_len -= left;
+				break;
+			}
+			left -= v->iov_len;
+		}
+		if (h->iov_ofs < h->iov_len) {
+			STAT_ADD(partial_writes, 1);
+			continue;
+		}
+		h2_batch_sent(h);
+		/* input left waiting for room in ctl[] */
+		if (h->in_len && !h2_parse(cl))
+			return 0;
+	}
+	if (!total)
+		return 1;
+	STAT_ADD(bytes_written, total);
+	cl->last = loop_now;
+	cl->begin = cl->last;
+	if (pace_rate) {
+		cl->tokens -= total < cl->tokens ? total : cl->tokens;
+		if (!cl->tokens && h2_pending(h))
+			return pace_park(cl);
+	}
+	return 1;
+}
+
+static int h2_read(struct client *cl)
+{
+	struct h2 *h = cl->h2;
+	ssize_t len;
+
+	if (h->goaway == 2 || h->in_len == sizeof(h->in))
+		return 1;
+#ifdef HAVE_OPENSSL
+	if (cl->ssl)
+		len = tls_read(cl, (char*)h->in + h->in_len,
+			sizeof(h->in) - h->in_len);
+	else
+#endif
+	len = read(cl->fd, h->in + h->in_len, sizeof(h->in) - h->in_len);
+	if (len <= 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR))
+			return 1;
+		log_debug("closing fd %d:%s\n", cl->fd,
+			len ? strerror(errno) : "end of file");
+		STAT_ADD(disconnects, 1);
+		return 0;
+	}
+	cl->last = loop_now;
+	if (cl->flags & CL_IDLE) {
+		cl->flags &= ~CL_IDLE;
+		cl->begin = cl->last;
+		timer_arm(cl);
+	}
+	h->in_len += len;
+	return h2_parse(cl);
+}
+
+/* the interest and state that go with what the connection is doing.
+ * it keeps reading while it writes, there may be WINDOW_UPDATEs. */
+static int h2_resume(struct client *cl)
+{
+	struct h2 *h = cl->h2;
+	int events = 0, state, pending = h2_pending(h);
+
+	if (h->goaway && !h->nstreams && !pending) {
+		log_debug("closing fd %d:GOAWAY\n", cl->fd);
+		return 0;
+	}
+	/* after our GOAWAY only that is left to write */
+	if (h->goaway < 2 && h->in_len < sizeof(h->in))
+		events |= EV_READ;
+	if (pending)
+		events |= EV_WRITE;
+	if (h->nstreams || pending) {
+		state = CONN_WRITE;
+	} else if (h->in_len || h->preface) {
+		state = CONN_READ;
+		conn_since[cl->fd] = cl->begin;
+	} else {
+		state = CONN_IDLE;
+		cl->flags |= CL_IDLE;
+		conn_since[cl->fd] = cl->last;
+	}
+	return client_set(cl, state, events);
+}
+
+/* what is written is usually the answer to what was just read, so the
+ * write is tried straight away rather than after another wakeup */
+static int h2_ready(struct client *cl, int events)
+{
+	struct h2 *h = cl->h2;
+
+	for (;;) {
+		if ((events & EV_READ) && !h2_read(cl))
+			return 0;
+		if (h2_pending(h) && !h2_write(cl))
+			return 0;
+		if (conn_state[cl->fd] == CONN_PACED)
+			return 1;
+#ifdef HAVE_OPENSSL
+		/* decrypted bytes that didn't fit, no event is coming */
+		if (cl->ssl && h->goaway < 2 && h->in_len < sizeof(h->in) &&
+			SSL_pending(cl->ssl)) {
+			events = EV_READ;
+			continue;
+		}
+#endif
+		return h2_resume(cl);
+	}
+}
+
+/* called by the event backend for every ready fd */
+static void event_ready(int fd, int events)
+{
+	struct client *cl;
+
+	if (fd >= 0 && fd < conn_len && conn_state[fd] >= CONN_LISTEN) {
+		client_accept(fd, conn_state[fd] == CONN_LISTEN_TLS);
+		return;
+	}
+#ifdef HAVE_INOTIFY
+	if (fd == inotify_fd) {
+		watch_read();
+		return;
+	}
+#endif
+	if (fd < 0 || fd >= conn_len || !(cl = conn_client[fd]))
+		return;
+	events &= cl->events;
+#ifdef HAVE_OPENSSL
+	if (cl->flags & CL_HANDSHAKE) {
+		if (events && !tls_handshake(cl))
+			client_free(cl);
+		return;
+	}
+#endif
+	if (cl->h2) {
+		if (events && !h2_ready(cl, events))
+			client_free(cl);
+		return;
+	}
+	if (cl->flags & CL_LINGER) {
+		if ((events & EV_READ) && !client_linger(cl))
+			client_free(cl);
+		return;
+	}
+	if ((events & EV_READ) && !client_read(cl)) {
+		log_debug("closing fd %d, disconnect\n", cl->fd);
+		client_free(cl);
+		return;
+	} else if ((events & EV_WRITE) && !client_write(cl)) {
+		log_debug("closing fd %d, disconnect\n", cl->fd);
+		client_free(cl);
+		return;
+	}
+#ifdef HAVE_OPENSSL
+	/* OpenSSL may hold decrypted bytes that didn't fit in in[], no event
+	 * is coming for those */
+	while (cl->ssl && cl->events == EV_READ && SSL_pending(cl->ssl)) {
+		if (!client_read(cl)) {
+			client_free(cl);
+			return;
+		}
+	}
+#endif
+}
+
+/* without Date, which reply_hdr() adds as it goes out */
+static size_t encode_hdr(char *buf, size_t size, time_t mtime,
+	const char *content_type, const char *encoding, const char *etag,
+	size_t length)
+{
+	char lastmod[64];
+	char encbuf[64] = "";
+	size_t len;
+
+	strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %T GMT",
+		gmtime(&mtime));
+	if (encoding)
+		snprintf(encbuf, sizeof(encbuf),
+			"Content-Encoding: %s\r\n", encoding);
+
+	len = snprintf(buf, size,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"ETag: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"%s"
+		"\r\n", content_type, lastmod, etag, length, encbuf,
+		NR_VARIANTS ? "Vary: Accept-Encoding\r\n" : "");
+	if (len >= size)
+		perror_and_die("snprintf()");
+	return len;
+}
+
+/* the answer to a conditional GET that matched, the same validators as
+ * the full one and no body */
+static size_t encode_304(char *buf, size_t size, time_t mtime,
+	const char *etag)
+{
+	char lastmod[64];
+	size_t len;
+
+	strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %T GMT",
+		gmtime(&mtime));
+	len = snprintf(buf, size,
+		"HTTP/1.1 304 Not Modified\r\n"
+		"Last-Modified: %s\r\n"
+		"ETag: %s\r\n"
+		"%s"
+		"\r\n", lastmod, etag,
+		NR_VARIANTS ? "Vary: Accept-Encoding\r\n" : "");
+	if (len >= size)
+		perror_and_die("snprintf()");
+	return len;
+}
+
+/* FNV-1a over the whole file, so a rewrite with the same size and mtime
+ * still changes the ETag */
+static uint64_t content_hash(const char *msg, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--) {
+		h ^= (unsigned char)*msg++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+#ifdef HAVE_ZLIB
+static size_t compress_gzip(char **out, const char *in, size_t in_len)
+{
+	z_stream zs;
+	size_t len;
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 + MAX_WBITS asks for a gzip wrapper instead of zlib */
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+		9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	len = deflateBound(&zs, in_len);
+	*out = malloc(len);
+	if (!*out) {
+		deflateEnd(&zs);
+		return 0;
+	}
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = in_len;
+	zs.next_out = (Bytef*)*out;
+	zs.avail_out = len;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(*out);
+		*out = NULL;
+		return 0;
+	}
+	len = zs.total_out;
+	deflateEnd(&zs);
+	return len;
+}
+#endif
+
+#ifdef HAVE_BROTLI
+static size_t compress_br(char **out, const char *in, size_t in_len)
+{
+	size_t len = BrotliEncoderMaxCompressedSize(in_len);
+
+	if (!len)
+		return 0;
+	*out = malloc(len);
+	if (!*out)
+		return 0;
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+		BROTLI_DEFAULT_MODE, in_len, (const uint8_t*)in, &len,
+		(uint8_t*)*out)) {
+		free(*out);
+		*out = NULL;
+		return 0;
+	}
+	return len;
+}
+#endif
+
+static int variant_cmp(const void *a, const void *b)
+{
+	const struct variant *va = a, *vb = b;
+
+	/* missing variants sort last */
+	if (!va->body || !vb->body)
+		return !va->body - !vb->body;
+	return (va->body_len > vb->body_len) - (va->body_len < vb->body_len);
+}
+
+/* compress msg with every encoding we know, keeping only the ones that
+ * actually save something. this is the only time compression happens. */
+static void encode_variants(struct entry *e)
+{
+	struct variant *v;
+	int i;
+
+	for (i = 0; i < NR_VARIANTS; i++) {
+		v = &e->variants[i];
+		v->enc = i;
+		v->body = NULL;
+		v->body_len = encodings[i].compress(&v->body, e->msg, e->msg_len);
+		if (v->body && v->body_len >= e->msg_len) {
+			free(v->body);
+			v->body = NULL;
+		}
+		if (!v->body) {
+			v->body_len = 0;
+			continue;
+		}
+		/* a different representation needs a different strong ETag */
+		snprintf(v->etag, sizeof(v->etag), "%.*s-%s\"",
+			(int)strlen(e->etag) - 1, e->etag, encodings[i].name);
+		v->hdr_len = encode_hdr(v->hdr, sizeof(v->hdr), e->st.st_mtime,
+			e->type, encodings[i].name, v->etag, v->body_len);
+		v->hdr304_len = encode_304(v->hdr304, sizeof(v->hdr304),
+			e->st.st_mtime, v->etag);
+		v->h2hdr_len = hpack_encode(v->h2hdr, sizeof(v->h2hdr),
+			v->hdr, v->hdr_len);
+		v->h2hdr304_len = hpack_encode(v->h2hdr304,
+			sizeof(v->h2hdr304), v->hdr304, v->hdr304_len);
+		log_debug("%s:%s variant is %zu bytes, identity %zu\n",
+			e->path, encodings[i].name, v->body_len, e->msg_len);
+	}
+	qsort(e->variants, NR_VARIANTS, sizeof(*e->variants), variant_cmp);
+}
+
+/* read name into e, whose path and type are already set. returns -1 with
+ * errno set on failure, e still has to be freed. */
+static int entry_load(struct entry *e, int dirfd, const char *name,
+	int compress)
+{
+	int fd;
+	ssize_t len;
+	int tries = 10;
+
+	e->msg_fd = -1;
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (zerocopy_fl) {
+		/* map the file instead of copying it, the mapping is only used
+		 * for the fallback path since the body goes out with sendfile() */
+		if (fstat(fd, &e->st))
+			goto fail;
+		e->msg_len = e->st.st_size;
+		if (e->msg_len) {
+			/* populated, for hashing and compressing it next */
+			e->msg = mmap(NULL, e->msg_len, PROT_READ,
+				MAP_SHARED | MAP_POPULATE, fd, 0);
+			if (e->msg == MAP_FAILED) {
+				e->msg = NULL;
+				goto fail;
+			}
+			e->map_len = e->msg_len;
+		}
+#ifdef HAVE_SENDFILE
+		e->msg_fd = fd;
+#else
+		close(fd);
+#endif
+	} else {
+		size_t room = 0;
+
+		do {
+			if (fstat(fd, &e->st))
+				goto fail;
+			e->msg_len = e->st.st_size;
+			/* a file that shrank still fits where it was */
+			if (!e->msg || e->msg_len > room) {
+				body_free(e);
+				room = e->msg_len;
+				e->msg = body_alloc(e, room);
+				if (!e->msg)
+					goto fail;
+			}
+			len = pread(fd, e->msg, e->msg_len, 0);
+			if (len < 0)
+				goto fail;
+			if (!tries--) { /* give up if we fail the race too many times */
+				log_info("%s:unable to determine size of file\n",
+					e->path);
+				errno = EAGAIN;
+				goto fail;
+			}
+		} while ((size_t)len != e->msg_len);
+		e->msg[e->msg_len] = 0;
+		/* nothing writes to it again */
+		if (e->map_len)
+			mprotect(e->msg, e->map_len, PROT_READ);
+		close(fd);
+	}
+	snprintf(e->etag, sizeof(e->etag), "\"%016llx\"",
+		(unsigned long long)content_hash(e->msg, e->msg_len));
+	e->hdr_len = encode_hdr(e->hdr, sizeof(e->hdr), e->st.st_mtime,
+		e->type, NULL, e->etag, e->msg_len);
+	e->hdr304_len = encode_304(e->hdr304, sizeof(e->hdr304),
+		e->st.st_mtime, e->etag);
+	e->h2hdr_len = hpack_encode(e->h2hdr, sizeof(e->h2hdr), e->hdr,
+		e->hdr_len);
+	e->h2hdr304_len = hpack_encode(e->h2hdr304, sizeof(e->h2hdr304),
+		e->hdr304, e->hdr304_len);
+	if (compress)
+		encode_variants(e);
+	return 0;
+fail:
+	if (e->msg_fd == -1) {
+		int saved = errno;
+
+		close(fd);
+		errno = saved;
+	}
+	return -1;
+}
+
+static struct content *content_new(void)
+{
+	struct content *c;
+
+	c = calloc(1, sizeof(*c));
+	if (c)
+		c->refs = 1;
+	return c;
+}
+
+/* a new entry at the end of c->entries, NULL if out of memory */
+static struct entry *content_add(struct content *c, const char *path,
+	const char *type)
+{
+	struct entry *e;
+
+	if (!(c->nentries & (c->nentries - 1))) {
+		/* doubling at every power of two */
+		e = realloc(c->entries, (c->nentries ? c->nentries * 2 : 1) *
+			sizeof(*e));
+		if (!e)
+			return NULL;
+		c->entries = e;
+	}
+	e = &c->entries[c->nentries];
+	memset(e, 0, sizeof(*e));
+	e->msg_fd = -1;
+	e->type = type;
+	e->path = strdup(path);
+	if (!e->path)
+		return NULL;
+	c->nentries++;
+	return e;
+}
+
+/* read the file into a new snapshot, or NULL if that isn't possible */
+static struct content *content_load(const char *path, int dirfd,
+	const char *name)
+{
+	struct content *c;
+	struct entry *e;
+
+	c = content_new();
+	if (!c || !(e = content_add(c, path, default_content_type))) {
+		perror(path);
+		if (c)
+			content_put(c);
+		return NULL;
+	}
+	if (entry_load(e, dirfd, name, 1)) {
+		perror(path);
+		content_put(c);
+		return NULL;
+	}
+	c->total = e->msg_len;
+	content_lock(c);
+	return c;
+}
+
+static const struct stats_counter {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t ofs;
+} stats_counters[] = {
+	{ "sopa_accepts_total", "counter", "Connections accepted.",
+		offsetof(struct stats, accepts) },
+	{ "sopa_requests_total", "counter", "Requests answered.",
+		offsetof(struct stats, requests) },
+	{ "sopa_bytes_written_total", "counter", "Bytes of replies sent.",
+		offsetof(struct stats, bytes_written) },
+	{ "sopa_partial_writes_total", "counter",
+		"Writes that left part of a reply for later.",
+		offsetof(struct stats, partial_writes) },
+	{ "sopa_timeouts_total", "counter", "Connections closed by a timeout.",
+		offsetof(struct stats, timeouts) },
+	{ "sopa_disconnects_total", "counter",
+		"Connections closed by the client or an error.",
+		offsetof(struct stats, disconnects) },
+	{ "sopa_wakeups_total", "counter",
+		"Returns from the event backend with events.",
+		offsetof(struct stats, wakeups) },
+	{ "sopa_clients", "gauge", "Connections open.",
+		offsetof(struct stats, clients) },
+	{ "sopa_log_dropped_total", "counter",
+		"Access log lines dropped because the buffer was full.",
+		offsetof(struct stats, log_dropped) },
+	{ "sopa_refused_total", "counter",
+		"Connections refused for being over the per-address limit.",
+		offsetof(struct stats, refused) },
+	{ "sopa_rejected_total", "counter",
+		"Requests rejected with a canned 400, 408, 414, 431 or 503.",
+		offsetof(struct stats, rejected) },
+	{ "sopa_shed_total", "counter",
+		"Waiting readers closed to make room for new connections.",
+		offsetof(struct stats, shed) },
+	{ "sopa_paced_total", "counter",
+		"Writers made to wait for the per-connection rate limit.",
+		offsetof(struct stats, paced) },
+	{ "sopa_tls_handshakes_total", "counter", "TLS handshakes completed.",
+		offsetof(struct stats, tls_handshakes) },
+	{ "sopa_tls_resumed_total", "counter",
+		"TLS handshakes that resumed a session.",
+		offsetof(struct stats, tls_resumed) },
+	{ "sopa_ktls_total", "counter",
+		"TLS connections whose sending went to kernel TLS.",
+		offsetof(struct stats, ktls) },
+	{ "sopa_h2_connections_total", "counter",
+		"Connections that switched to HTTP/2.",
+		offsetof(struct stats, h2) },
+	{ NULL, NULL, NULL, 0 }
+};
+
+/* every worker's counters in the Prometheus text format */
+static void stats_print(FILE *f)
+{
+	const struct stats_counter *sc;
+	unsigned w, i;
+
+	for (sc = stats_counters; sc->name; sc++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", sc->name, sc->help,
+			sc->name, sc->type);
+		for (w = 0; w < stats_count; w++) {
+			const uint64_t *v = (const uint64_t*)
+				((const char*)&stats_all[w] + sc->ofs);
+
+			fprintf(f, "%s{worker=\"%u\"} %llu\n", sc->name, w,
+				(unsigned long long)
+				__atomic_load_n(v, __ATOMIC_RELAXED));
+		}
+	}
+	fprintf(f, "# HELP sopa_loop_seconds Time to handle the events of "
+		"one wakeup.\n# TYPE sopa_loop_seconds histogram\n");
+	for (w = 0; w < stats_count; w++) {
+		const struct stats *st = &stats_all[w];
+		uint64_t count = 0;
+
+		for (i = 0; i < STATS_BUCKETS; i++) {
+			count += __atomic_load_n(&st->loop_hist[i],
+				__ATOMIC_RELAXED);
+			if (i + 1 < STATS_BUCKETS)
+				fprintf(f, "sopa_loop_seconds_bucket{worker=\"%u\","
+					"le=\"%.6f\"} %llu\n", w,
+					(double)(1ull << i) / 1e6,
+					(unsigned long long)count);
+			else
+				fprintf(f, "sopa_loop_seconds_bucket{worker=\"%u\","
+					"le=\"+Inf\"} %llu\n", w,
+					(unsigned long long)count);
+		}
+		fprintf(f, "sopa_loop_seconds_sum{worker=\"%u\"} %.6f\n", w,
+			__atomic_load_n(&st->loop_usec, __ATOMIC_RELAXED) / 1e6);
+		fprintf(f, "sopa_loop_seconds_count{worker=\"%u\"} %llu\n", w,
+			(unsigned long long)count);
+	}
+}
+
+/* a snapshot of its own for one stats reply, freed once it is sent */
+static struct content *stats_content(void)
+{
+	struct content *c;
+	struct entry *e;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return NULL;
+	stats_print(f);
+	if (fclose(f)) {
+		free(buf);
+		return NULL;
+	}
+	c = content_new();
+	if (!c || !(e = content_add(c, stats_path,
+		"text/plain; version=0.0.4"))) {
+		free(buf);
+		if (c)
+			content_put(c);
+		return NULL;
+	}
+	e->msg = buf;
+	e->msg_len = len;
+	e->hdr_len = snprintf(e->hdr, sizeof(e->hdr),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Cache-Control: no-store\r\n"
+		"\r\n", e->type, len);
+	e->h2hdr_len = hpack_encode(e->h2hdr, sizeof(e->h2hdr), e->hdr,
+		e->hdr_len);
+	return c;
+}
+
+static const struct mime_type {
+	const char *ext;
+	const char *type;
+	int compress; /* worth trying gzip and brotli on */
+} mime_types[] = {
+	{ "html", "text/html; charset=UTF-8", 1 },
+	{ "htm", "text/html; charset=UTF-8", 1 },
+	{ "css", "text/css; charset=UTF-8", 1 },
+	{ "js", "text/javascript; charset=UTF-8", 1 },
+	{ "json", "application/json", 1 },
+	{ "txt", "text/plain; charset=UTF-8", 1 },
+	{ "xml", "application/xml", 1 },
+	{ "svg", "image/svg+xml", 1 },
+	{ "ico", "image/x-icon", 1 },
+	{ "wasm", "application/wasm", 1 },
+	{ "png", "image/png", 0 },
+	{ "gif", "image/gif", 0 },
+	{ "jpg", "image/jpeg", 0 },
+	{ "jpeg", "image/jpeg", 0 },
+	{ "webp", "image/webp", 0 },
+	{ "woff", "font/woff", 0 },
+	{ "woff2", "font/woff2", 0 },
+	{ "pdf", "application/pdf", 0 },
+	{ "mp4", "video/mp4", 0 },
+	{ NULL, "application/octet-stream", 0 }
+};
+
+static const struct mime_type *mime_lookup(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	const struct mime_type *m;
+
+	for (m = mime_types; m->ext; m++)
+		if (dot && !strcasecmp(dot + 1, m->ext))
+			break;
+	return m;
+}
+
+/* add every regular file under the directory fd to c, dotfiles excepted.
+ * prefix is the request-target of the directory, ending in a slash. takes
+ * ownership of fd. */
+/* a file or directory we aren't allowed to read is left out, with a
+ * message, rather than failing the whole load */
+static int unreadable(const char *path)
+{
+	if (errno != EACCES && errno != EPERM)
+		return 0;
+	log_info("%s:%s, skipped\n", path, strerror(errno));
+	return 1;
+}
+
+static int content_walk(struct content *c, int fd, const char *prefix,
+	int depth)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int e = 0;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		perror(prefix);
+		close(fd);
+		return -1;
+	}
+	while (!e && (de = readdir(dir))) {
+		const struct mime_type *m;
+		struct entry *ent;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if ((size_t)snprintf(path, sizeof(path), "%s%s", prefix,
+			de->d_name) >= sizeof(path) - 1) {
+			log_info("%s%s:name too long, skipped\n", prefix,
+				de->d_name);
+			continue;
+		}
+		if (fstatat(dirfd(dir), de->d_name, &st, 0)) {
+			if (errno == ENOENT)
+				continue; /* removed while we were looking */
+			perror(path);
+			e = -1;
+		} else if (S_ISDIR(st.st_mode)) {
+			if (depth >= HTTP_MAXDEPTH) {
+				log_info("%s:too deep, skipped\n", path);
+				continue;
+			}
+			fd = openat(dirfd(dir), de->d_name,
+				O_RDONLY | O_DIRECTORY);
+			if (fd == -1 && unreadable(path))
+				continue;
+			if (fd == -1) {
+				perror(path);
+				e = -1;
+				continue;
+			}
+			strcat(path, "/");
+			e = content_walk(c, fd, path, depth + 1);
+		} else if (S_ISREG(st.st_mode)) {
+			m = mime_lookup(de->d_name);
+			ent = content_add(c, path, m->type);
+			if (ent && entry_load(ent, dirfd(dir), de->d_name,
+				m->compress)) {
+				if (unreadable(path)) {
+					entry_free(ent);
+					c->nentries--;
+					continue;
+				}
+				ent = NULL;
+			}
+			if (!ent) {
+				perror(path);
+				e = -1;
+				continue;
+			}
+			c->total += ent->msg_len;
+		}
+	}
+	closedir(dir);
+	return e;
+}
+
+static void route_add(struct content *c, const char *key, size_t len,
+	const struct entry *e)
+{
+	struct route *r;
+	uint32_t h = path_hash(key, len);
+	unsigned i;
+
+	for (i = h & c->route_mask; c->routes[i].key;
+		i = (i + 1) & c->route_mask)
+		;
+	r = &c->routes[i];
+	r->key = key;
+	r->key_len = len;
+	r->hash = h;
+	r->entry = e;
+}
+
+/* hash every entry by its path, and directories by their index.html. the
+ * table is kept at most half full so probe sequences stay short. */
+static int content_route(struct content *c)
+{
+	static const char index_name[] = "index.html";
+	const size_t index_len = sizeof(index_name) - 1;
+	unsigned size = 2;
+	unsigned i;
+
+	while (size < 4 * c->nentries)
+		size *= 2;
+	c->routes = calloc(size, sizeof(*c->routes));
+	if (!c->routes)
+		return -1;
+	c->route_mask = size - 1;
+	for (i = 0; i < c->nentries; i++) {
+		const struct entry *e = &c->entries[i];
+		size_t len = strlen(e->path);
+
+		route_add(c, e->path, len, e);
+		if (len > index_len && e->path[len - index_len - 1] == '/' &&
+			!strcmp(e->path + len - index_len, index_name))
+			route_add(c, e->path, len - index_len, e);
+	}
+	return 0;
+}
+
+/* load the tree under content_dir into a new snapshot */
+static struct content *content_load_tree(void)
+{
+	struct content *c;
+	int fd;
+
+	c = content_new();
+	if (!c) {
+		perror(docroot);
+		return NULL;
+	}
+	/* a descriptor of our own, closedir() closes it */
+	fd = openat(content_dir, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fstat(fd, &c->st)) {
+		perror(docroot);
+		if (fd != -1)
+			close(fd);
+		content_put(c);
+		return NULL;
+	}
+	if (content_walk(c, fd, "/", 0)) {
+		content_put(c);
+		return NULL;
+	}
+	if (content_route(c)) {
+		perror(docroot);
+		content_put(c);
+		return NULL;
+	}
+	content_lock(c);
+	return c;
+}
+
+static void load_file(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+
+	dir = strdup(slash ? path : ".");
+	if (!dir)
+		perror_and_die("strdup()");
+	if (slash)
+		dir[slash - path + 1] = 0; /* keep the slash for "/file" */
+	content_dir = open(dir, O_RDONLY | O_DIRECTORY);
+	if (content_dir == -1)
+		perror_and_die(dir);
+	free(dir);
+	content_name = slash ? slash + 1 : path;
+	current = content_load(path, content_dir, content_name);
+	if (!current)
+		exit(EXIT_FAILURE);
+}
+
+static void load_tree(const char *dir)
+{
+	content_dir = open(dir, O_RDONLY | O_DIRECTORY);
+	if (content_dir == -1)
+		perror_and_die(dir);
+	current = content_load_tree();
+	if (!current)
+		exit(EXIT_FAILURE);
+	log_info("%s:%u files, %zu bytes\n", dir, current->nentries,
+		current->total);
+}
+
+static int stat_changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev != b->st_dev || a->st_ino != b->st_ino ||
+		a->st_size != b->st_size || a->st_mtime != b->st_mtime;
+}
+
+/* has anything changed since c was loaded? */
+static int content_stale(const struct content *c)
+{
+	struct stat st;
+	unsigned i;
+
+	if (content_name) {
+		if (fstatat(content_dir, content_name, &st, 0))
+			return 0; /* keep serving what we have */
+		return stat_changed(&st, &c->entries[0].st);
+	}
+	/* files added or removed at the top, or any file we have changing */
+	if (fstat(content_dir, &st) || stat_changed(&st, &c->st))
+		return 1;
+	for (i = 0; i < c->nentries; i++)
+		if (fstatat(content_dir, c->entries[i].path + 1, &st, 0) ||
+			stat_changed(&st, &c->entries[i].st))
+			return 1;
+	return 0;
+}
+
+/* swap in a new snapshot, clients in the middle of a reply finish it from
+ * the one they started with */
+static void reload_file(void)
+{
+	const char *name = content_name ? filename : docroot;
+	struct content *c;
+
+	reload_pending = 0;
+	if (content_name)
+		c = content_load(filename, content_dir, content_name);
+	else
+		c = content_load_tree();
+	if (!c) {
+		log_info("%s:reload failed, keeping the old content\n", name);
+		return;
+	}
+	content_put(current);
+	current = c;
+	log_info("%s:reloaded, %u files, %zu bytes\n", name, c->nentries,
+		c->total);
+}
+
+static void on_reload(int sig __attribute__((unused)))
+{
+	reload_pending = 1;
+}
+
+static void on_drain(int sig __attribute__((unused)))
+{
+	if (!drain_pending)
+		drain_pending = 1;
+}
+
+#ifdef HAVE_INOTIFY
+/* watch the directory, editors and deploys usually rename a new file into
+ * place, which a watch on the file itself would miss. only the top of a
+ * tree is watched, changes further down need a SIGHUP. */
+static void watch_init(void)
+{
+	uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+	char dir[64];
+
+	/* by descriptor, the path may not be searchable after drop_root() */
+	snprintf(dir, sizeof(dir), "/proc/self/fd/%d", content_dir);
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1()");
+		return;
+	}
+	if (!content_name)
+		mask |= IN_DELETE | IN_MOVED_FROM;
+	if (inotify_add_watch(inotify_fd, dir, mask) < 0 ||
+		ev->set(inotify_fd, 0, EV_READ)) {
+		perror("inotify_add_watch()");
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+}
+
+static void watch_read(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	char *p;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ie = (void*)p;
+
+			/* any change at the top of a tree */
+			if (ie->len && (!content_name ||
+				!strcmp(ie->name, content_name)))
+				reload_pending = 1;
+			p += sizeof(*ie) + ie->len;
+		}
+	}
+}
+#endif
+
+static void drop_root(void)
+{
+	if (getuid() == 0)
+		if (setuid(HTTP_USER))
+			perror_and_die("setuid()");
+}
+
+static void daemonize(void)
+{
+	pid_t pid;
+	pid_t sid;
+
+	/* check if we're already a daemon */
+	if (getppid() == 1)
+		return;
+
+	if (chdir("/") < 0)
+		perror_and_die("chdir()");
+	pid = fork();
+	if (pid == (pid_t)-1)
+		perror_and_die("fork()");
+	if (pid)
+		exit(EXIT_SUCCESS); /* exit parent */
+	sid = setsid();
+	if (sid == (pid_t)-1)
+		perror_and_die("setsid()");
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+	open("/dev/null", O_RDONLY);
+	open("/dev/null", O_WRONLY);
+	open("/dev/null", O_WRONLY);
+}
+
+static struct listener *listener_new(void)
+{
+	struct listener *l;
+
+	l = realloc(listeners, (nlisteners + 1) * sizeof(*l));
+	if (!l)
+		perror_and_die("realloc()");
+	listeners = l;
+	l += nlisteners++;
+	memset(l, 0, sizeof(*l));
+	return l;
+}
+
+/* add the listener for -l, [tls:]addr:port with an IPv4 address, an IPv6
+ * one in brackets or * for every IPv4 address, or [tls:]unix:path */
+static void listener_add(const char *spec)
+{
+	struct listener *l = listener_new();
+	const char *p = spec, *port;
+	char host[INET6_ADDRSTRLEN];
+	size_t len;
+	char *end;
+	long n;
+	int v6 = 0;
+
+	if (!strncmp(p, "tls:", 4)) {
+		l->tls = 1;
+		p += 4;
+	}
+	if (!strncmp(p, "unix:", 5)) {
+		struct sockaddr_un *sun = (struct sockaddr_un*)&l->addr;
+
+		p += 5;
+		if (!*p || strlen(p) >= sizeof(sun->sun_path))
+			goto bad;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, p);
+		l->addr_len = sizeof(*sun);
+		return;
+	}
+	if (*p == '[') {
+		port = strchr(p, ']');
+		if (!port || port[1] != ':')
+			goto bad;
+		p++;
+		len = port - p;
+		port += 2;
+		v6 = 1;
+	} else if ((port = strrchr(p, ':'))) {
+		len = port - p;
+		port++;
+	} else {
+		len = 0; /* just a port */
+		port = p;
+	}
+	if (len >= sizeof(host))
+		goto bad;
+	memcpy(host, p, len);
+	host[len] = 0;
+	n = strtol(port, &end, 10);
+	if (!*port || *end || n < 0 || n > 65535)
+		goto bad;
+	if (v6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&l->addr;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(n);
+		if (inet_pton(AF_INET6, host, &sin6->sin6_addr) != 1)
+			goto bad;
+		l->addr_len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in*)&l->addr;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(n);
+		if (len && strcmp(host, "*") &&
+			inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+			goto bad;
+		l->addr_len = sizeof(*sin);
+	}
+	return;
+bad:
+	fprintf(stderr, "%s:bad listen address %s\n", progname, spec);
+	exit(EXIT_FAILURE);
+}
+
+/* take over a socket path left behind by a server that is gone. one that
+ * still answers is left alone, for bind() to fail on. */
+static void listen_unlink(const struct sockaddr_un *sun)
+{
+	struct stat st;
+	int fd;
+
+	if (lstat(sun->sun_path, &st) || !S_ISSOCK(st.st_mode))
+		return;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return;
+	if (connect(fd, (const struct sockaddr*)sun, sizeof(*sun)) &&
+		errno == ECONNREFUSED)
+		unlink(sun->sun_path);
+	close(fd);
+}
+
+/* TCP_DEFER_ACCEPT leaves a connection in the backlog until its request
+ * arrives, so a wakeup always has something to read. a returning client
+ * with a TCP_FASTOPEN cookie sends its request in the SYN and saves the
+ * round trip of the handshake. set once listening, which is how sockets
+ * passed in arrive. */
+static void listen_tcp_opts(int fd)
+{
+#ifdef SO_ACCEPTFILTER
+	struct accept_filter_arg afa;
+#endif
+
+#ifdef TCP_DEFER_ACCEPT
+	if (defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			&defer_accept, sizeof(defer_accept)))
+		perror_and_die("TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+	if (fastopen_qlen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+			&fastopen_qlen, sizeof(fastopen_qlen)))
+		perror_and_die("TCP_FASTOPEN");
+#endif
+#ifdef SO_BUSY_POLL
+	/* accepted sockets inherit it, raising it takes CAP_NET_ADMIN */
+	if (busy_poll && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+			sizeof(busy_poll)))
+		perror_and_die("SO_BUSY_POLL");
+#endif
+#ifdef SO_ACCEPTFILTER
+	/* the BSD take on TCP_DEFER_ACCEPT */
+	if (defer_accept) {
+		memset(&afa, 0, sizeof(afa));
+		strcpy(afa.af_name, "dataready");
+		if (setsockopt(fd, SOL_SOCKET, SO_ACCEPTFILTER, &afa,
+				sizeof(afa)))
+			log_info("SO_ACCEPTFILTER:%s\n", strerror(errno));
+	}
+#endif
+}
+
+/* create a non-blocking listening socket, with SO_REUSEPORT when several
+ * workers each need their own accept queue on the same port. */
+static int listen_open(const struct listener *l, int reuseport)
+{
+	int family = l->addr.ss_family;
+	int fd;
+	int e;
+	int op = 1;
+	mode_t mask;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0)
+		perror_and_die("socket()");
+	if (family == AF_UNIX) {
+		listen_unlink((const struct sockaddr_un*)&l->addr);
+		reuseport = 0;
+	} else {
+		e = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &op, sizeof(op));
+		if (e)
+			perror_and_die("SO_REUSEADDR");
+	}
+	if (reuseport) {
+#ifdef SO_REUSEPORT
+		e = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &op, sizeof(op));
+		if (e)
+			perror_and_die("SO_REUSEPORT");
+#else
+		log_info("SO_REUSEPORT is not supported, use a single worker\n");
+		exit(EXIT_FAILURE);
+#endif
+	}
+	/* so [::] and * can be told apart, and both listened on */
+	if (family == AF_INET6) {
+		e = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &op, sizeof(op));
+		if (e)
+			perror_and_die("IPV6_V6ONLY");
+	}
+	/* a Unix socket is for the owner and group to connect to, 0660 */
+	mask = umask(family == AF_UNIX ? 0117 : 0);
+	e = bind(fd, (const struct sockaddr*)&l->addr, l->addr_len);
+	umask(mask);
+	if (e)
+		perror_and_die("bind()");
+	e = fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (e)
+		perror_and_die("fcntl()");
+	e = listen(fd, SOMAXCONN);
+	if (e)
+		perror_and_die("listen()");
+	if (family != AF_UNIX)
+		listen_tcp_opts(fd);
+	return fd;
+}
+
+/* the sockets of every listener not taken over, for count workers */
+static void listeners_open(int count)
+{
+	struct listener *l;
+	int i;
+
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		if (l->fds)
+			continue;
+		l->shared = l->addr.ss_family == AF_UNIX;
+		l->owned = l->shared;
+		l->nfds = l->shared ? 1 : count;
+		l->fds = calloc(l->nfds, sizeof(*l->fds));
+		if (!l->fds)
+			perror_and_die("calloc()");
+		for (i = 0; i < l->nfds; i++)
+			l->fds[i] = listen_open(l, count > 1);
+	}
+}
+
+/* close the sockets of the other workers, or with keep -1 all of them.
+ * a worker leaves the socket paths to its parent. */
+static void listeners_close(int keep)
+{
+	struct listener *l;
+	int i;
+
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		for (i = 0; i < l->nfds; i++)
+			if (keep < 0 || (!l->shared && i != keep))
+				close(l->fds[i]);
+		if (keep < 0)
+			l->nfds = 0;
+		else
+			l->owned = 0;
+	}
+}
+
+/* remove the paths of our Unix sockets on the way out, unless they went to
+ * the next server. it may be too late: a directory only root can write to
+ * leaves them for listen_unlink() at the next start. */
+static void listeners_unlink(void)
+{
+	const struct sockaddr_un *sun;
+	struct listener *l;
+
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		sun = (const struct sockaddr_un*)&l->addr;
+		if (l->owned && unlink(sun->sun_path) && errno != ENOENT)
+			log_info("%s:%s\n", sun->sun_path, strerror(errno));
+	}
+}
+
+/**** taking over listeners ****/
+
+/* listening sockets passed in by systemd or by an old server, until they
+ * are matched up with the listeners */
+struct inherited {
+	int fd;
+	int tls;
+	int owned; /* by the server we took it from, not by systemd */
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+};
+
+#define HANDOFF_MAX 64
+
+static struct inherited inherited[HANDOFF_MAX];
+static unsigned ninherited;
+static int handoff_fd = -1; /* where the next server asks for our sockets */
+/* the server at the other end of a handoff, until the new one is up */
+static int handoff_peer = -1;
+static int handed_off; /* they are the next server's now */
+/* each new worker writes a byte once it is up, while handoff_peer waits */
+static int ready_pipe[2] = { -1, -1 };
+
+static void inherit_add(int fd, int tls, int owned)
+{
+	struct inherited *in = &inherited[ninherited];
+	socklen_t len = sizeof(int);
+	int op = 0;
+
+	if (ninherited == HANDOFF_MAX) {
+		log_info("fd %d:too many listening sockets passed in\n", fd);
+		close(fd);
+		return;
+	}
+	in->addr_len = sizeof(in->addr);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &op, &len) || !op ||
+		getsockname(fd, (struct sockaddr*)&in->addr, &in->addr_len) ||
+		fcntl(fd, F_SETFL, O_NONBLOCK)) {
+		log_info("fd %d:not a listening socket\n", fd);
+		close(fd);
+		return;
+	}
+	in->fd = fd;
+	in->tls = tls;
+	in->owned = owned;
+	ninherited++;
+}
+
+/* socket activation, sd_listen_fds() without libsystemd. a socket named
+ * "tls" with FileDescriptorName= is a TLS one. */
+static void inherit_systemd(void)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	const char *names = getenv("LISTEN_FDNAMES");
+	int i, n;
+
+	if (!pid || !fds || atol(pid) != (long)getpid())
+		return;
+	n = atoi(fds);
+	for (i = 0; i < n; i++) {
+		size_t len = names ? strcspn(names, ":") : 0;
+
+		inherit_add(3 + i, len == 3 && !strncmp(names, "tls", 3), 0);
+		if (names) {
+			names += len;
+			if (*names)
+				names++;
+		}
+	}
+	/* not for anything we might start */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+}
+
+static void handoff_addr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "%s:%s:path too long\n", progname, path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(sun->sun_path, path);
+}
+
+/* a byte is sent along with each socket handed over */
+#define HANDOFF_PLAIN 0
+#define HANDOFF_TLS 1
+#define HANDOFF_SELF 2 /* the socket the handoff itself is asked for on */
+
+/* seconds for the old server to send its sockets, and for our workers to
+ * come up once the content is loaded */
+#define HANDOFF_TIMEOUT 10
+
+/* take the listening sockets of the server answering on path. it carries
+ * on serving until handoff_ready() tells it we are up, so the connection
+ * stays open until then. nothing if there is no server. */
+static void handoff_receive(const char *path)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(HANDOFF_MAX * sizeof(int))];
+	} cm;
+	char flags[HANDOFF_MAX];
+	struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *c;
+	ssize_t len;
+	int fd, i, n;
+
+	handoff_addr(&sun, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		perror_and_die("socket()");
+	if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+		close(fd);
+		return; /* a first start */
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		perror_and_die("SO_RCVTIMEO");
+	iov.iov_base = flags;
+	iov.iov_len = sizeof(flags);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = sizeof(cm.buf);
+	len = recvmsg(fd, &msg, 0);
+	if (len < 0)
+		perror_and_die("recvmsg()");
+	if (!len) {
+		fprintf(stderr, "%s:%s:hung up on us\n", progname, path);
+		exit(EXIT_FAILURE);
+	}
+	/* the kernel has closed the ones that didn't fit */
+	if (msg.msg_flags & MSG_CTRUNC) {
+		fprintf(stderr, "%s:%s:too many sockets handed over\n",
+			progname, path);
+		exit(EXIT_FAILURE);
+	}
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++) {
+			int newfd;
+
+			memcpy(&newfd, CMSG_DATA(c) + i * sizeof(int),
+				sizeof(newfd));
+			if (i < len && flags[i] == HANDOFF_SELF)
+				handoff_fd = newfd;
+			else
+				inherit_add(newfd,
+					i < len && flags[i] == HANDOFF_TLS, 1);
+		}
+	}
+	handoff_peer = fd;
+	log_info("%s:took over %u listening sockets\n", path, ninherited);
+}
+
+/* answer on path for the next server. only root, or whoever we were started
+ * as, can connect. */
+static void handoff_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int e;
+
+	handoff_addr(&sun, path);
+	handoff_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (handoff_fd < 0)
+		perror_and_die("socket()");
+	listen_unlink(&sun);
+	mask = umask(077);
+	e = bind(handoff_fd, (struct sockaddr*)&sun, sizeof(sun));
+	umask(mask);
+	if (e)
+		perror_and_die("bind()");
+	if (listen(handoff_fd, 1))
+		perror_and_die("listen()");
+}
+
+/* pass every listening socket to the server connecting on handoff_fd, with
+ * a byte for each saying what it is, handoff_fd itself last so the next
+ * server answers on the same path. we keep serving until handoff_acked()
+ * hears from it. */
+static void handoff_send(void)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(HANDOFF_MAX * sizeof(int))];
+	} cm;
+	char flags[HANDOFF_MAX];
+	int fds[HANDOFF_MAX];
+	const struct listener *l;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *c;
+	unsigned n = 0;
+	int fd, i;
+
+	fd = accept(handoff_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		for (i = 0; i < l->nfds && n < HANDOFF_MAX - 1; i++) {
+			fds[n] = l->fds[i];
+			flags[n++] = l->tls ? HANDOFF_TLS : HANDOFF_PLAIN;
+		}
+	}
+	fds[n] = handoff_fd;
+	flags[n++] = HANDOFF_SELF;
+	iov.iov_base = flags;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cm.buf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+	if (sendmsg(fd, &msg, 0) < 0) {
+		log_info("handoff:%s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	handoff_peer = fd;
+	log_info("sent %u listening sockets, waiting for the new server\n",
+		n - 1);
+}
+
+/* the new server says it is up, or has hung up without: 1 if it is time to
+ * drain. it bounds its own startup, so there is no timeout here, and one
+ * that hangs leaves us serving. */
+static int handoff_acked(void)
+{
+	char ack;
+	ssize_t len;
+
+	len = read(handoff_peer, &ack, 1);
+	if (len < 0 && errno == EINTR)
+		return 0;
+	close(handoff_peer);
+	handoff_peer = -1;
+	if (len <= 0) {
+		log_info("the new server failed to start, carrying on\n");
+		return 0;
+	}
+	/* the new server answers on it now */
+	close(handoff_fd);
+	handoff_fd = -1;
+	handed_off = 1;
+	log_info("handed over to the new server\n");
+	return 1;
+}
+
+/* wait for each of count workers to be up, then tell the old server to
+ * drain. 0 if it has been told. */
+static int handoff_ready(int count)
+{
+	struct pollfd pfd;
+	uint64_t deadline, now;
+	char buf[64];
+	ssize_t len;
+	int ok;
+
+	close(ready_pipe[1]);
+	ready_pipe[1] = -1;
+	deadline = mono_usec() + HANDOFF_TIMEOUT * 1000000ULL;
+	pfd.fd = ready_pipe[0];
+	pfd.events = POLLIN;
+	/* EOF is the last of them gone, ready or not */
+	while (count > 0) {
+		now = mono_usec();
+		if (now >= deadline)
+			break;
+		if (poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0)
+			continue;
+		len = read(ready_pipe[0], buf, sizeof(buf));
+		if (len > 0)
+			count -= len;
+		else if (!len || errno != EINTR)
+			break;
+	}
+	close(ready_pipe[0]);
+	ready_pipe[0] = -1;
+	ok = count <= 0 && write(handoff_peer, "", 1) == 1;
+	if (!ok) {
+		log_info("handoff:workers didn't come up, the old server carries on\n");
+		handed_off = 1; /* the sockets are still the old server's */
+	}
+	close(handoff_peer);
+	handoff_peer = -1;
+	return ok ? 0 : -1;
+}
+
+static int addr_equal(const struct sockaddr_storage *a,
+	const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4 = (const void*)a, *b4 = (const void*)b;
+	const struct sockaddr_in6 *a6 = (const void*)a, *b6 = (const void*)b;
+	const struct sockaddr_un *au = (const void*)a, *bu = (const void*)b;
+
+	if (a->ss_family != b->ss_family)
+		return 0;
+	switch (a->ss_family) {
+	case AF_INET:
+		return a4->sin_port == b4->sin_port &&
+			a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	case AF_INET6:
+		return a6->sin6_port == b6->sin6_port &&
+			!memcmp(&a6->sin6_addr, &b6->sin6_addr,
+				sizeof(a6->sin6_addr));
+	case AF_UNIX:
+		return !strcmp(au->sun_path, bu->sun_path);
+	}
+	return 0;
+}
+
+/* give the sockets passed in to the listeners with their address, or
+ * without -l, listen on just them. the rest are closed. */
+static void listeners_adopt(int count)
+{
+	struct listener *l;
+	unsigned i;
+
+	if (!nlisteners) {
+		for (i = 0; i < ninherited; i++) {
+			for (l = listeners; l < listeners + nlisteners; l++)
+				if (addr_equal(&l->addr, &inherited[i].addr))
+					break;
+			if (l < listeners + nlisteners)
+				continue;
+			l = listener_new();
+			l->addr = inherited[i].addr;
+			l->addr_len = inherited[i].addr_len;
+			l->tls = inherited[i].tls;
+		}
+	}
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		for (i = 0; i < ninherited; i++) {
+			int *fds;
+
+			if (inherited[i].fd < 0 ||
+				!addr_equal(&l->addr, &inherited[i].addr))
+				continue;
+			fds = realloc(l->fds, (l->nfds + 1) * sizeof(*fds));
+			if (!fds)
+				perror_and_die("realloc()");
+			l->fds = fds;
+			l->fds[l->nfds++] = inherited[i].fd;
+			l->owned |= inherited[i].owned;
+			inherited[i].fd = -1;
+			/* whoever bound it may not have set them */
+			if (l->addr.ss_family != AF_UNIX)
+				listen_tcp_opts(l->fds[l->nfds - 1]);
+		}
+		/* one each keeps the accept queue of every worker */
+		if (l->nfds)
+			l->shared = l->addr.ss_family == AF_UNIX ||
+				l->nfds != count;
+	}
+	for (i = 0; i < ninherited; i++) {
+		if (inherited[i].fd < 0)
+			continue;
+		log_info("fd %d:not a listener any more, closing\n",
+			inherited[i].fd);
+		close(inherited[i].fd);
+	}
+}
+
+/* stop accepting and let the connections there are finish. idle ones are
+ * closed as they come up, and the worker exits once there are none. */
+static void worker_drain(void)
+{
+	struct listener *l;
+	int fd, i;
+
+	if (drain_pending == 1) {
+		drain_pending = 2;
+		for (l = listeners; l < listeners + nlisteners; l++) {
+			for (i = 0; i < l->nfds; i++) {
+				if (!listener_mine(l, i))
+					continue;
+				fd = l->fds[i];
+				if (!accept_paused)
+					ev->set(fd, EV_READ, 0);
+				conn_state[fd] = CONN_FREE;
+				close(fd);
+			}
+		}
+		accept_paused = 0;
+		while (conn_top > 0 && conn_state[conn_top - 1] == CONN_FREE)
+			conn_top--;
+		log_info("worker %d draining %u connections\n", worker_id,
+			pool_used);
+	}
+	for (fd = 0; fd < conn_top; fd++)
+		if (conn_state[fd] == CONN_IDLE)
+			client_free(conn_client[fd]);
+	if (!pool_used) {
+		listeners_unlink();
+		if (access_fd != -1)
+			log_flush();
+		exit(EXIT_SUCCESS);
+	}
+}
+
+/**** cpu placement ****/
+
+#ifdef HAVE_AFFINITY
+/* the id'th of the cpus we were started on, wrapping around, or -1 */
+static int cpu_pick(int id)
+{
+	cpu_set_t set;
+	int n, cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	n = CPU_COUNT(&set);
+	if (!n)
+		return -1;
+	id %= n;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set) && !id--)
+			return cpu;
+	return -1;
+}
+
+/* before the worker touches any state of its own, so the first write to
+ * each page of it, and with it the page, lands on the node of this cpu.
+ * pages shared with the parent are copied there on write too. */
+static void worker_pin(void)
+{
+	cpu_set_t set;
+
+	worker_cpu = cpu_pick(worker_id);
+	if (worker_cpu < 0) {
+		log_info("worker %d:no cpu to pin to\n", worker_id);
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(worker_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		perror_and_die("sched_setaffinity()");
+	/* whatever numactl had the parent interleave or bind to */
+	if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0))
+		log_info("set_mempolicy():%s\n", strerror(errno));
+	log_info("worker %d on cpu %d\n", worker_id, worker_cpu);
+}
+#endif
+
+/* a connection goes to the worker whose cpu took its packets in. that is
+ * also its NIC queue's, once queue interrupts are spread one per core. */
+static void listen_cpu(int fd)
+{
+#ifdef SO_INCOMING_CPU
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &worker_cpu,
+			sizeof(worker_cpu)))
+		log_info("SO_INCOMING_CPU:%s\n", strerror(errno));
+#else
+	(void)fd;
+#endif
+}
+
+/* event loop of one worker, never returns */
+static void serve(const char *backend)
+{
+	struct listener *l;
+	struct sigaction sa;
+	int e, i;
+
+	clock_update();
+	wheel_now = loop_now;
+	stats = &stats_all[worker_id];
+#ifdef HAVE_AFFINITY
+	if (pin_fl)
+		worker_pin();
+#endif
+	pool_init();
+	peer_init();
+	/* what accept_reserve() gives up when the descriptors run out */
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	/* after fork(), since a kqueue or epoll must not be shared */
+	event_init(backend);
+	/* all of them in the one loop, known apart from clients by state */
+	for (l = listeners; l < listeners + nlisteners; l++) {
+		for (i = 0; i < l->nfds; i++) {
+			int fd = l->fds[i];
+
+			if (!listener_mine(l, i))
+				continue;
+			if (fd >= conn_len && conn_grow(fd))
+				perror_and_die("realloc()");
+			conn_state[fd] = l->tls ? CONN_LISTEN_TLS : CONN_LISTEN;
+			if (fd >= conn_top)
+				conn_top = fd + 1;
+			if (worker_cpu >= 0 && !l->shared &&
+				l->addr.ss_family != AF_UNIX)
+				listen_cpu(fd);
+			if (ev->set(fd, 0, EV_READ))
+				perror_and_die("listener");
+		}
+	}
+	/* no SA_RESTART, so a SIGHUP or SIGQUIT wakes up the backend */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_reload;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = on_drain;
+	sigaction(SIGQUIT, &sa, NULL);
+#ifdef HAVE_INOTIFY
+	watch_init();
+#endif
+	if (content_stale(current))
+		reload_file(); /* changed while we were being started */
+	if (ready_pipe[1] != -1) {
+		/* for handoff_ready(), we are taking connections */
+		if (write(ready_pipe[1], "", 1) < 0)
+			log_info("ready:%s\n", strerror(errno));
+		close(ready_pipe[1]);
+		ready_pipe[1] = -1;
+	}
+
+	while (1) {
+		int timeout_ms;
+
+		if (terminating) {
+			/* a single worker, with no parent to send SIGTERM */
+			listeners_unlink();
+			if (access_fd != -1)
+				log_flush();
+			exit(EXIT_SUCCESS);
+		}
+		if (drain_pending)
+			worker_drain();
+		if (access_fd != -1)
+			log_flush();
+		/* as of the last wakeup, so the wait can come out a little
+		 * late but never early */
+		timeout_ms = timer_next_ms(loop_now);
+		if (paced_head) {
+			int ms = pace_next_ms();
+
+			if (timeout_ms < 0 || ms < timeout_ms)
+				timeout_ms = ms;
+		}
+		if (accept_paused) {
+			int ms = accept_paused > loop_usec ?
+				(accept_paused - loop_usec + 999) / 1000 : 0;
+
+			if (timeout_ms < 0 || ms < timeout_ms)
+				timeout_ms = ms;
+		}
+		if (timeout_ms >= 0) {
+			log_debug("wait for %d ms\n", timeout_ms);
+		} else {
+			log_debug("waiting for new connections\n");
 		}
 #ifndef NDEBUG
-		printf("rfds: "); dump_fdset(&rfds);
-		printf("wfds: "); dump_fdset(&wfds);
-		printf("readers: "); dump_list(reader_head);
-		printf("writers: "); dump_list(writer_head);
+		printf("readers: "); dump_conns(CONN_READ);
+		printf("idle: "); dump_conns(CONN_IDLE);
+		printf("writers: "); dump_conns(CONN_WRITE);
+		printf("paced: "); dump_conns(CONN_PACED);
 #endif
-		e = select(fd_max + 1, &rfds, &wfds, NULL, tv);
+		e = ev->wait(timeout_ms);
 		if (e < 0)
-			perror_and_die("select()");
-		if (FD_ISSET(listen_fd, &rfds)) {
-			client_accept(listen_fd);
-			e--;
+			perror_and_die(ev->name);
+		if (!loop_start)
+			clock_update(); /* timed out, loop_awake() wasn't called */
+		if (reload_pending)
+			reload_file();
+		if (paced_head)
+			pace_resume();
+		if (accept_paused && loop_usec >= accept_paused)
+			accept_resume();
+		timer_expire(loop_now);
+		loop_done();
+	}
+}
+
+/**** worker processes ****/
+
+static void on_terminate(int sig __attribute__((unused)))
+{
+	terminating = 1;
+}
+
+/* a worker is restarted at most once a second, and one that dies this
+ * many times within a second of starting isn't going to come up */
+#define WORKER_FAILS_MAX 5
+
+static void on_child(int sig __attribute__((unused)))
+{
+}
+
+static pid_t worker_start(int id, const char *backend)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == (pid_t)-1) {
+		perror("fork()");
+		return pid;
+	}
+	if (pid)
+		return pid;
+	/* child - keep only our own listening sockets */
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	listeners_close(id);
+	if (handoff_fd != -1)
+		close(handoff_fd);
+	if (handoff_peer != -1)
+		close(handoff_peer);
+	if (ready_pipe[0] != -1)
+		close(ready_pipe[0]);
+	worker_id = id;
+	serve(backend);
+	exit(EXIT_SUCCESS);
+}
+
+/* the parent only supervises: it restarts workers that die, passes
+ * termination, SIGHUP and SIGQUIT along, and hands the listeners over to a
+ * new server asking on handoff_fd. the content is shared copy-on-write
+ * with every worker until one of them reloads it. */
+static void supervise(int count, const char *backend)
+{
+	struct sigaction sa;
+	pid_t *pids;
+	uint64_t *started; /* mono_usec() of the last fork() of each */
+	int *fails; /* exits in a row within a second of starting */
+	int failed = 0, aborted = 0;
+	pid_t pid;
+	int i;
+
+	pids = calloc(count, sizeof(*pids));
+	started = calloc(count, sizeof(*started));
+	fails = calloc(count, sizeof(*fails));
+	if (!pids || !started || !fails)
+		perror_and_die("calloc()");
+	/* no SA_RESTART, poll() has to return so we notice a signal */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_terminate;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = on_reload;
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = on_drain;
+	sigaction(SIGQUIT, &sa, NULL);
+	sa.sa_handler = on_child;
+	sigaction(SIGCHLD, &sa, NULL);
+	if (handoff_peer != -1 && pipe(ready_pipe))
+		perror_and_die("pipe()");
+	for (i = 0; i < count; i++) {
+		started[i] = mono_usec();
+		pids[i] = worker_start(i, backend);
+	}
+	if (handoff_peer != -1 && handoff_ready(count)) {
+		aborted = 1; /* let what they did take finish */
+		on_drain(SIGQUIT);
+	}
+	while (!terminating && !failed) {
+		struct pollfd pfd;
+		int status, live = 0;
+
+		/* the timeout retries a failed fork(), and covers a SIGCHLD
+		 * that came just before the poll() */
+		pfd.fd = handoff_peer != -1 ? handoff_peer : handoff_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, pfd.fd != -1, 1000) > 0) {
+			if (handoff_peer == -1)
+				handoff_send();
+			else if (handoff_acked())
+				on_drain(SIGQUIT);
+		}
+		if (reload_pending) {
+			reload_pending = 0;
+			for (i = 0; i < count; i++)
+				if (pids[i] > 0)
+					kill(pids[i], SIGHUP);
+		}
+		if (drain_pending == 1) {
+			/* nothing more for our backlogs, they'd be dropped */
+			drain_pending = 2;
+			listeners_close(-1);
+			if (handoff_fd != -1) {
+				close(handoff_fd);
+				handoff_fd = -1;
+			}
+			/* a new server waiting on us is left to give up */
+			if (handoff_peer != -1) {
+				close(handoff_peer);
+				handoff_peer = -1;
+			}
+			for (i = 0; i < count; i++)
+				if (pids[i] > 0)
+					kill(pids[i], SIGQUIT);
+		}
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < count; i++) {
+				if (pids[i] != pid)
+					continue;
+				pids[i] = 0;
+				if (drain_pending)
+					continue;
+				if (mono_usec() - started[i] < 1000000)
+					fails[i]++;
+				else
+					fails[i] = 0;
+				if (fails[i] >= WORKER_FAILS_MAX) {
+					log_info("worker %d (pid %d) keeps exiting on startup, giving up\n",
+						i, (int)pid);
+					failed = 1;
+				} else {
+					log_info("worker %d (pid %d) exited, restarting\n",
+						i, (int)pid);
+				}
+			}
+		}
+		for (i = 0; i < count; i++) {
+			if (pids[i] <= 0 && !drain_pending && !failed &&
+				mono_usec() - started[i] >= 1000000) {
+				started[i] = mono_usec();
+				pids[i] = worker_start(i, backend);
+			}
+			if (pids[i] > 0)
+				live++;
+		}
+		if (drain_pending && !live)
+			break;
+	}
+	for (i = 0; i < count; i++)
+		if (pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	if (!handed_off)
+		listeners_unlink();
+	free(pids);
+	free(started);
+	free(fails);
+	if (failed) {
+		listeners_close(-1);
+		exit(EXIT_FAILURE);
+	}
+	if (aborted)
+		exit(EXIT_FAILURE);
+}
+
+void usage(void)
+{
+	const struct event_backend **b;
+
+	fprintf(stderr, "usage: %s [-hd] [-f <filename> | -r <dir>] [-p <port>] [-l <addr>]... [-t <type>] [-b <backend>] [-w <n>] [-c <n>] [-a <n>] [-T <n>] [-k <n>] [-H <n>] [-i <n>] [-B <n>] [-N <n>] [-R <n>] [-s <path>] [-L <file>] [-S <n>] [-C <cert> [-K <key>] [-P <port>]] [-U <path>] [-z | -M] [-m] [-D <n>] [-F <n>] [-A] [-Y <n>]\n",
+		progname);
+	fprintf(stderr, "  -h    help\n");
+	fprintf(stderr, "  -d    don't daemonize\n");
+	fprintf(stderr, "  -f f  file to serve, for any path\n");
+	fprintf(stderr, "  -r d  directory tree to serve, / is index.html\n");
+	fprintf(stderr, "  -p n  port to serve, on every IPv4 address, without -l [%d]\n", HTTP_PORT);
+	fprintf(stderr, "  -l a  listen on a, any number of times, instead of -p and -P:\n");
+	fprintf(stderr, "        [tls:]port, [tls:]1.2.3.4:port, [tls:][::1]:port or [tls:]unix:path\n");
+	fprintf(stderr, "  -t t  content type of -f [%s]\n", default_content_type);
+	fprintf(stderr, "  -b b  event backend [");
+	for (b = backends; *b; b++)
+		fprintf(stderr, "%s%s", (*b)->name, b[1] ? "|" : "]\n");
+	fprintf(stderr, "  -w n  worker processes, each with a SO_REUSEPORT socket [1]\n");
+	fprintf(stderr, "  -c n  maximum clients per worker [%d]\n", HTTP_MAXCLIENTS);
+	fprintf(stderr, "  -a n  connections to accept per wakeup [%d]\n", HTTP_ACCEPT_BUDGET);
+	fprintf(stderr, "  -T n  seconds a request or reply may stall [%d]\n", HTTP_TIMEOUT);
+	fprintf(stderr, "  -k n  seconds to keep an idle connection open [%d]\n", HTTP_IDLE_TIMEOUT);
+	fprintf(stderr, "  -H n  seconds for all of a request header to arrive, at least -T [%d]\n", HTTP_HEADER_TIMEOUT);
+	fprintf(stderr, "  -i n  connections per client address, per worker [unlimited]\n");
+	fprintf(stderr, "  -B n  SO_SNDBUF of each connection, in bytes [system default]\n");
+#ifdef TCP_NOTSENT_LOWAT
+	fprintf(stderr, "  -N n  TCP_NOTSENT_LOWAT of each connection, in bytes [system default]\n");
+#endif
+	fprintf(stderr, "  -R n  bytes per second sent to each connection [unlimited]\n");
+	fprintf(stderr, "  -s p  answer path with counters for Prometheus, e.g. /__stats\n");
+	fprintf(stderr, "  -L f  access log in the combined format\n");
+	fprintf(stderr, "  -S n  log one request in n [1]\n");
+	fprintf(stderr, "  -C f  also serve TLS, with this PEM certificate chain\n");
+	fprintf(stderr, "  -K f  PEM private key of -C [the -C file]\n");
+	fprintf(stderr, "  -P n  port for TLS [%d]\n", HTTPS_PORT);
+	fprintf(stderr, "  -U p  take the listeners over from the server answering on Unix socket p,\n");
+	fprintf(stderr, "        then answer there for the next one, which this one drains for\n");
+	fprintf(stderr, "  -z    zero-copy, mmap the file and send it with sendfile()\n");
+	fprintf(stderr, "        (replace the file with rename(), don't rewrite it)\n");
+	fprintf(stderr, "  -M    copy big files into prefaulted mappings, on huge pages if possible\n");
+	fprintf(stderr, "  -m    lock the content in memory so it is never paged out\n");
+#if defined(TCP_DEFER_ACCEPT) || defined(SO_ACCEPTFILTER)
+	fprintf(stderr, "  -D n  seconds a TCP connection may wait for its request before accept() [off]\n");
+#endif
+#ifdef TCP_FASTOPEN
+	fprintf(stderr, "  -F n  TCP_FASTOPEN queue length of each TCP listener [off]\n");
+#endif
+#ifdef HAVE_AFFINITY
+	fprintf(stderr, "  -A    pin each worker to a cpu, with its memory and its share of connections\n");
+#endif
+#ifdef SO_BUSY_POLL
+	fprintf(stderr, "  -Y n  microseconds to busy-poll the NIC for each socket read [off]\n");
+#endif
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int daemonize_fl = 1;
+	int workers = 1;
+	unsigned n;
+	int tls_wanted = 0;
+	const char *backend = NULL;
+	const char *access_path = NULL;
+	const char *tls_cert = NULL, *tls_key = NULL;
+	const char *handoff_path = NULL;
+	unsigned short port = HTTP_PORT;
+	unsigned short tls_port = HTTPS_PORT;
+
+	progname = strrchr(argv[0], '/');
+	if (progname)
+		progname++;
+	else
+		progname = argv[0];
+
+	while ((c=getopt(argc, argv, "hdf:r:p:l:t:b:w:c:a:T:k:H:i:B:N:R:s:L:S:C:K:P:U:zMmD:F:AY:"))>0) {
+		switch(c) {
+		default:
+		case 'h':
+			usage();
+		case 'd':
+			daemonize_fl = 0;
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'r':
+			docroot = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'l':
+			listener_add(optarg);
+			break;
+		case 't':
+			default_content_type = optarg;
+			break;
+		case 'b':
+			backend = optarg;
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			if (workers < 1)
+				usage();
+			break;
+		case 'c':
+			if (atoi(optarg) < 1)
+				usage();
+			pool_size = atoi(optarg);
+			break;
+		case 'a':
+			if (atoi(optarg) < 1)
+				usage();
+			accept_budget = atoi(optarg);
+			break;
+		case 'T':
+			if (atoi(optarg) < 1)
+				usage();
+			read_timeout = atoi(optarg);
+			break;
+		case 'k':
+			if (atoi(optarg) < 1)
+				usage();
+			idle_timeout = atoi(optarg);
+			break;
+		case 'H':
+			if (atoi(optarg) < 1)
+				usage();
+			header_timeout = atoi(optarg);
+			break;
+		case 'i':
+			if (atoi(optarg) < 1)
+				usage();
+			peer_limit = atoi(optarg);
+			break;
+		case 'B':
+			if (atoi(optarg) < 1)
+				usage();
+			sndbuf = atoi(optarg);
+			break;
+		case 'N':
+			if (atoi(optarg) < 1)
+				usage();
+			notsent_lowat = atoi(optarg);
+			break;
+		case 'R':
+			if (atol(optarg) < PACE_HZ)
+				usage();
+			pace_rate = atol(optarg);
+			pace_depth = pace_rate / PACE_HZ;
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 'L':
+			access_path = optarg;
+			break;
+		case 'S':
+			if (atoi(optarg) < 1)
+				usage();
+			log_every = atoi(optarg);
+			break;
+		case 'C':
+			tls_cert = optarg;
+			break;
+		case 'K':
+			tls_key = optarg;
+			break;
+		case 'P':
+			tls_port = atoi(optarg);
+			break;
+		case 'U':
+			handoff_path = optarg;
+			break;
+		case 'z':
+			zerocopy_fl = 1;
+			break;
+		case 'M':
+			mapstore_fl = 1;
+			break;
+		case 'm':
+			mlock_fl = 1;
+			break;
+		case 'D':
+			if (atoi(optarg) < 1)
+				usage();
+			defer_accept = atoi(optarg);
+			break;
+		case 'F':
+			if (atoi(optarg) < 1)
+				usage();
+			fastopen_qlen = atoi(optarg);
+			break;
+		case 'A':
+			pin_fl = 1;
+			break;
+		case 'Y':
+			if (atoi(optarg) < 1)
+				usage();
+			busy_poll = atoi(optarg);
+			break;
+		}
+	}
+	inherit_systemd();
+	if (handoff_path)
+		handoff_receive(handoff_path);
+	if (ninherited)
+		listeners_adopt(workers);
+	if (!nlisteners) {
+		char spec[16];
+
+		snprintf(spec, sizeof(spec), "%u", port);
+		listener_add(spec);
+		if (tls_cert) {
+			snprintf(spec, sizeof(spec), "tls:%u", tls_port);
+			listener_add(spec);
 		}
-		FD_SET(listen_fd, &rfds);
-		youngest = INT_MAX; /* processing will update this */
-		process_readers();
-		process_writers();
 	}
-	close(listen_fd);
+	for (n = 0; n < nlisteners; n++)
+		tls_wanted |= listeners[n].tls;
+	if (tls_wanted != !!tls_cert) {
+		fprintf(stderr, "%s:%s\n", progname, tls_cert ?
+			"-C needs a tls: listener" : "tls: listener needs -C");
+		return EXIT_FAILURE;
+	}
+#ifndef HAVE_OPENSSL
+	if (tls_cert) {
+		fprintf(stderr, "%s:built without TLS\n", progname);
+		return EXIT_FAILURE;
+	}
+	(void)tls_key;
+#endif
+
+	if (header_timeout < read_timeout)
+		header_timeout = read_timeout;
+
+	umask(0);
+	/* a client leaving mid-reply is an EPIPE, not a reason to exit */
+	signal(SIGPIPE, SIG_IGN);
+	/* bind everything before drop_root(), workers can't bind port 80 */
+	listeners_open(workers);
+	/* unless it came with the old server's sockets */
+	if (handoff_path && handoff_fd == -1)
+		handoff_listen(handoff_path);
+#ifdef HAVE_OPENSSL
+	/* the key is often readable only by root, like port 443 */
+	if (tls_cert)
+		tls_init(tls_cert, tls_key ? tls_key : tls_cert);
+#endif
+	stats_init(workers);
+	if (access_path)
+		log_open(access_path); /* before drop_root(), like the sockets */
+	if (mlock_fl) {
+		struct rlimit rl;
+
+		/* while we may, so workers can lock what they reload too */
+		rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+		setrlimit(RLIMIT_MEMLOCK, &rl);
+	}
+
+	drop_root();
+	clock_update();
+	hpack_init();
+	canned_init(&not_found, "404 Not Found", "");
+	canned_init(&not_allowed, "405 Method Not Allowed",
+		"Allow: GET, HEAD\r\nConnection: close\r\n");
+	canned_init(&bad_request, "400 Bad Request", "Connection: close\r\n");
+	canned_init(&timed_out, "408 Request Timeout",
+		"Connection: close\r\n");
+	canned_init(&uri_too_long, "414 URI Too Long",
+		"Connection: close\r\n");
+	canned_init(&fields_too_large, "431 Request Header Fields Too Large",
+		"Connection: close\r\n");
+	canned_init(&unavailable, "503 Service Unavailable",
+		"Retry-After: 1\r\nConnection: close\r\n");
+	if (docroot)
+		load_tree(docroot);
+	else
+		load_file(filename);
+
+	if (daemonize_fl)
+		daemonize();
+
+	if (workers == 1 && !handoff_path) {
+		struct sigaction sa;
+
+		/* no SA_RESTART, the wait has to return for it */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_terminate;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+		serve(backend);
+	}
+	supervise(workers, backend);
+	listeners_close(-1);
 	return 0;
 }